@@ -564,6 +564,22 @@ void GroupProcess::updated(int64_t sessionId, const string& path)
 }
 
 
+void GroupProcess::connectedReadOnly(int64_t sessionId)
+{
+  // Groups have to write, their sessions never settle for read-only
+  // servers.
+  LOG(FATAL) << "Unexpected read-only ZooKeeper session";
+}
+
+
+void GroupProcess::changed(int64_t sessionId, const string& path)
+{
+  // Memberships are only watched for coming and going, treat any data
+  // change alike.
+  updated(sessionId, path);
+}
+
+
 void GroupProcess::created(int64_t sessionId, const string& path)
 {
   LOG(FATAL) << "Unexpected ZooKeeper event";
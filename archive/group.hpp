@@ -203,9 +203,11 @@ public:
   // ZooKeeper events.
   // Note that events from previous sessions are dropped.
   void connected(int64_t sessionId, bool reconnect);
+  void connectedReadOnly(int64_t sessionId);
   void reconnecting(int64_t sessionId);
   void expired(int64_t sessionId);
   void updated(int64_t sessionId, const std::string& path);
+  void changed(int64_t sessionId, const std::string& path);
   void created(int64_t sessionId, const std::string& path);
   void deleted(int64_t sessionId, const std::string& path);
 
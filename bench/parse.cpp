@@ -0,0 +1,120 @@
+// Compares parsing instance configs written as JSON against the same
+// configs written as protobuf, see parseConfig(). Build and run with
+//
+//     make bench && ./bench/parse
+//
+// Configs are parsed the way refreshes do, one fetched buffer at a
+// time, and spread over a few shapes so that no single one is measured
+// out of cache.
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "instance.pb.h"
+
+using std::string;
+using std::vector;
+
+static const int CONFIGS = 1000;
+static const int ROUNDS = 1000;
+
+static string jsonConfig(int i) {
+    string config = "{\"host\":\"10.0." + std::to_string(i / 250) + "." + std::to_string(i % 250) + "\"," +
+                    "\"port\":" + std::to_string(8000 + i % 100) + "," +
+                    "\"name\":\"web-" + std::to_string(i) + ".example.com\"";
+    if (i % 2 == 0) {
+        config += ",\"weight\":" + std::to_string(1 + i % 100);
+    }
+    return config + "}";
+}
+
+static string protobufConfig(int i) {
+    service_discovery::InstanceConfig config;
+    config.set_host("10.0." + std::to_string(i / 250) + "." + std::to_string(i % 250));
+    config.set_port(8000 + i % 100);
+    config.set_name("web-" + std::to_string(i) + ".example.com");
+    if (i % 2 == 0) {
+        config.set_weight(1 + i % 100);
+    }
+    string serialized;
+    config.SerializeToString(&serialized);
+    return serialized;
+}
+
+typedef std::function<Try<Instance>(const string &)> Parser;
+
+// Nanoseconds a parse, failing if any config does not parse to what
+// it was written from.
+static bool measure(const Parser &parse, const vector<string> &configs, double *nanoseconds) {
+    int64_t ports = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (auto &config : configs) {
+            Try<Instance> instance = parse(config);
+            if (instance.isError()) {
+                fprintf(stderr, "failed to parse: %s\n", instance.error().c_str());
+                return false;
+            }
+            ports += instance.get().port;
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    *nanoseconds = elapsed / ((double) ROUNDS * configs.size());
+
+    int64_t expected = 0;
+    for (int i = 0; i < CONFIGS; i++) {
+        expected += 8000 + i % 100;
+    }
+    return ports == expected * ROUNDS;
+}
+
+static size_t averageSize(const vector<string> &configs) {
+    size_t total = 0;
+    for (auto &config : configs) {
+        total += config.size();
+    }
+    return total / configs.size();
+}
+
+int main() {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    vector<string> json;
+    vector<string> indentedJson;
+    vector<string> protobuf;
+    for (int i = 0; i < CONFIGS; i++) {
+        json.push_back(jsonConfig(i));
+        // Tried as protobuf first, see parseConfig().
+        indentedJson.push_back(" " + jsonConfig(i));
+        protobuf.push_back(protobufConfig(i));
+    }
+
+    struct Case {
+        const char *name;
+        Parser parse;
+        const vector<string> *configs;
+    };
+    vector<Case> cases = {
+        {"json, parseJsonConfig", parseJsonConfig, &json},
+        {"json, parseConfig", parseConfig, &json},
+        {"indented json, parseConfig", parseConfig, &indentedJson},
+        {"protobuf, parseProtobufConfig", parseProtobufConfig, &protobuf},
+        {"protobuf, parseConfig", parseConfig, &protobuf},
+    };
+
+    printf("%d configs, %d rounds\n", CONFIGS, ROUNDS);
+    for (auto &parseCase : cases) {
+        double nanoseconds;
+        if (!measure(parseCase.parse, *parseCase.configs, &nanoseconds)) {
+            fprintf(stderr, "%s: configs parsed wrong\n", parseCase.name);
+            return 1;
+        }
+        printf("  %-30s %4zu bytes %8.1f ns/config %8.2f M configs/s\n",
+               parseCase.name, averageSize(*parseCase.configs), nanoseconds, 1e3 / nanoseconds);
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Compares picks drawn from randomBelow() against the rand() % total
+// they replaced, in throughput across threads and in how evenly they
+// spread over instances. Build and run with
+//
+//     make bench && ./bench/pick
+//
+// Instances are laid out as cumulative weights and located by binary
+// search, the way PackedService::locate() does.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "random.hpp"
+
+using std::string;
+using std::vector;
+
+static const uint64_t PICKS = 10000000;
+
+static size_t locate(const vector<uint64_t> &cumulative, uint64_t offset) {
+    return std::upper_bound(cumulative.begin(), cumulative.end(), offset) - cumulative.begin();
+}
+
+static vector<uint64_t> cumulativeOf(const vector<uint64_t> &weights) {
+    vector<uint64_t> cumulative;
+    uint64_t total = 0;
+    for (auto weight : weights) {
+        total += weight;
+        cumulative.push_back(total);
+    }
+    return cumulative;
+}
+
+static uint64_t pickRand(uint64_t total) {
+    return rand() % total;
+}
+
+static uint64_t pickRandom(uint64_t total) {
+    return randomBelow(total);
+}
+
+typedef std::function<uint64_t(uint64_t)> Picker;
+
+// Millions of picks a second, over all threads.
+static double throughput(const Picker &pick, const vector<uint64_t> &cumulative, int threads) {
+    uint64_t total = cumulative.back();
+    uint64_t perThread = PICKS / threads;
+    vector<uint64_t> sinks(threads);
+    vector<std::thread> running;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++) {
+        running.push_back(std::thread([&, i]() {
+            uint64_t sink = 0;
+            for (uint64_t n = 0; n < perThread; n++) {
+                sink += locate(cumulative, pick(total));
+            }
+            sinks[i] = sink;
+        }));
+    }
+    for (auto &thread : running) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return perThread * threads / seconds / 1e6;
+}
+
+// How far the share of picks an instance got strays from its share of
+// the weight, at worst, in percent of the latter, along with the
+// chi-square statistic over all instances.
+static void spread(const Picker &pick, const vector<uint64_t> &weights, double *worst, double *chiSquare) {
+    vector<uint64_t> cumulative = cumulativeOf(weights);
+    uint64_t total = cumulative.back();
+    vector<uint64_t> hits(weights.size(), 0);
+    for (uint64_t n = 0; n < PICKS; n++) {
+        hits[locate(cumulative, pick(total))]++;
+    }
+    *worst = 0;
+    *chiSquare = 0;
+    for (size_t i = 0; i < weights.size(); i++) {
+        double expected = (double) PICKS * weights[i] / total;
+        double deviation = hits[i] - expected;
+        *worst = std::max(*worst, fabs(deviation) / expected * 100);
+        *chiSquare += deviation * deviation / expected;
+    }
+}
+
+struct Layout {
+    string name;
+    vector<uint64_t> weights;
+};
+
+int main() {
+    srand(time(NULL));
+
+    vector<Layout> layouts;
+    layouts.push_back(Layout{"7 even instances", vector<uint64_t>(7, 100)});
+    // A total past RAND_MAX / 2, where rand() % total favours the
+    // instances at the front twice over.
+    layouts.push_back(Layout{"3 instances weighing 500M", vector<uint64_t>(3, 500000000)});
+    Layout skewed{"1000 instances weighing 1..1000", vector<uint64_t>()};
+    for (uint64_t weight = 1; weight <= 1000; weight++) {
+        skewed.weights.push_back(weight);
+    }
+    layouts.push_back(skewed);
+
+    vector<std::pair<string, Picker> > pickers;
+    pickers.push_back(std::make_pair(string("rand() % total"), Picker(pickRand)));
+    pickers.push_back(std::make_pair(string("randomBelow(total)"), Picker(pickRandom)));
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    vector<int> threadCounts = {1, (int) std::min(4u, cores), (int) cores};
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    printf("%llu picks a run\n", (unsigned long long) PICKS);
+    for (auto &layout : layouts) {
+        printf("\n%s\n", layout.name.c_str());
+        vector<uint64_t> cumulative = cumulativeOf(layout.weights);
+        for (auto &picker : pickers) {
+            double worst, chiSquare;
+            spread(picker.second, layout.weights, &worst, &chiSquare);
+            printf("  %-20s worst %7.3f%%  chi-square %14.1f (%zu degrees of freedom)\n",
+                   picker.first.c_str(), worst, chiSquare, layout.weights.size() - 1);
+            for (auto threads : threadCounts) {
+                printf("  %-20s %3d thread(s) %8.1f M picks/s\n",
+                       "", threads, throughput(picker.second, cumulative, threads));
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <google/protobuf/io/zero_copy_stream_impl.h> // For ArrayInputStream.
+
+#include <sstream>
+
+#include <stout/error.hpp>
+#include <stout/json.hpp>
+
+#include "config.hpp"
+#include "instance.pb.h"
+
+using std::string;
+
+bool isJsonConfig(const string &instanceConfig) {
+    return instanceConfig.empty() || instanceConfig[0] == '{';
+}
+
+Try<Instance> parseProtobufConfig(const string &instanceConfig) {
+    service_discovery::InstanceConfig config;
+    google::protobuf::io::ArrayInputStream stream(instanceConfig.data(), instanceConfig.size());
+    if (!config.ParseFromZeroCopyStream(&stream)) {
+        return Error("invalid protobuf config");
+    }
+
+    if (!config.has_host() || !config.has_port()) {
+        return Error("config host or port is not found, skipping");
+    }
+    Instance instance;
+    instance.host = config.host();
+    instance.port = config.port();
+    instance.name = config.name();
+    instance.weight = config.has_weight() ? config.weight() : -1;
+    instance.mzxid = 0;
+    instance.ctime = 0;
+    return instance;
+}
+
+Try<Instance> parseJsonConfig(const string &instanceConfig) {
+    picojson::value value;
+    std::istringstream is(instanceConfig);
+    string err = picojson::parse(value, is);
+    if (!err.empty()) {
+        return Error(err);
+    }
+
+    if (!value.contains(CONFIG_HOST) || !value.contains(CONFIG_PORT)) {
+        return Error("config host or port is not found, skipping");
+    }
+    Instance instance;
+    instance.host = value.get(CONFIG_HOST).to_str();
+    picojson::value port = value.get(CONFIG_PORT);
+    if (port.is<int>()) {
+        instance.port = (int) port.get<double>();
+    } else {
+        return Error("invalid config value port, skipping this instance");
+    }
+    instance.name = value.get(CONFIG_NAME).to_str();
+    picojson::value weight = value.get(CONFIG_WEIGHT);
+    instance.weight = weight.is<int>() ? (int) weight.get<double>() : -1;
+    instance.mzxid = 0;
+    instance.ctime = 0;
+    return instance;
+}
+
+Try<Instance> parseConfig(const string &instanceConfig) {
+    if (!isJsonConfig(instanceConfig)) {
+        Try<Instance> instance = parseProtobufConfig(instanceConfig);
+        if (instance.isSome()) {
+            return instance;
+        }
+    }
+    return parseJsonConfig(instanceConfig);
+}
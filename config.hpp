@@ -0,0 +1,34 @@
+#ifndef __SERVICE_DISCOVERY_CONFIG_HPP__
+#define __SERVICE_DISCOVERY_CONFIG_HPP__
+
+#include <string>
+
+#include <stout/try.hpp>
+
+#include "registry.hpp"
+
+// Fields of the JSON instance config nerve writes.
+const std::string CONFIG_HOST = "host";
+const std::string CONFIG_PORT = "port";
+const std::string CONFIG_NAME = "name";
+const std::string CONFIG_WEIGHT = "weight";
+
+// Whether a config is JSON rather than protobuf. JSON configs are
+// written as objects with nothing in front, while protobuf configs
+// start with the tag of one of the fields in instance.proto, none of
+// which reads as '{'.
+bool isJsonConfig(const std::string &instanceConfig);
+
+// Parses a protobuf config in place, straight out of the buffer the
+// data was fetched into.
+Try<Instance> parseProtobufConfig(const std::string &instanceConfig);
+
+Try<Instance> parseJsonConfig(const std::string &instanceConfig);
+
+// Instance configs are JSON, or protobuf from newer publishers, see
+// instance.proto. Whatever does not parse as protobuf is still given to
+// the JSON parser, so JSON with leading whitespace keeps working. The
+// node, zxid and creation time are left for the caller to fill in.
+Try<Instance> parseConfig(const std::string &instanceConfig);
+
+#endif // __SERVICE_DISCOVERY_CONFIG_HPP__
@@ -0,0 +1,205 @@
+#include <queue>
+
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/future.hpp>
+#include <process/id.hpp>
+#include <process/process.hpp>
+
+#include <stout/lambda.hpp>
+#include <stout/none.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/uuid.hpp>
+
+#include "archive/contender.hpp"
+#include "archive/detector.hpp"
+#include "archive/group.hpp"
+#include "election.hpp"
+#include "log.hpp"
+
+using namespace process;
+
+using std::string;
+
+using zookeeper::Group;
+using zookeeper::LeaderContender;
+using zookeeper::LeaderDetector;
+
+// How long to wait before contending or detecting again after the
+// group failed us.
+const Duration ELECTION_RETRY_INTERVAL = Seconds(1);
+
+class LeaderElectionProcess : public Process<LeaderElectionProcess> {
+public:
+    LeaderElectionProcess(const string &servers,
+                          const Duration &timeout,
+                          const string &znode,
+                          const std::function<void(bool)> &leading,
+                          const string &data,
+                          const std::function<void(const Option<string> &)> &elected);
+
+    virtual ~LeaderElectionProcess();
+
+    virtual void initialize();
+
+private:
+    void contend();
+
+    void candidacy(const Future<Future<Nothing> > &candidacy);
+
+    void detect();
+
+    void detected(const Future<Option<Group::Membership> > &leader);
+
+    // Tells whether the leader is us, by the data it joined with.
+    void fetched(const Group::Membership &leader, const Future<Option<string> > &data);
+
+    void lead(bool leading);
+
+    void elect(const Option<string> &data);
+
+    Group group;
+    LeaderContender *contender;
+    LeaderDetector detector;
+
+    // What we join the group with, tells our membership from others.
+    // Followed by the data of the candidate on a line of its own.
+    const string id;
+    const string payload;
+    const std::function<void(bool)> leading;
+    const std::function<void(const Option<string> &)> elected;
+
+    // The leader seen last, none before the first election.
+    Option<Group::Membership> leader;
+    bool isLeading;
+
+    // Data of the leader told last, none before the first election.
+    Option<Option<string> > electedData;
+};
+
+LeaderElectionProcess::LeaderElectionProcess(
+        const string &servers,
+        const Duration &timeout,
+        const string &znode,
+        const std::function<void(bool)> &_leading,
+        const string &_data,
+        const std::function<void(const Option<string> &)> &_elected)
+        : ProcessBase(ID::generate("leader-election")),
+          group(servers, timeout, znode),
+          contender(NULL),
+          detector(&group),
+          id(UUID::random().toString()),
+          payload(_data),
+          leading(_leading),
+          elected(_elected),
+          isLeading(false) { }
+
+LeaderElectionProcess::~LeaderElectionProcess() {
+    // Cancels our membership, letting someone else take over.
+    delete contender;
+}
+
+void LeaderElectionProcess::initialize() {
+    contend();
+    detect();
+}
+
+void LeaderElectionProcess::contend() {
+    // Contenders are not reusable, every candidacy takes a new one.
+    delete contender;
+    contender = new LeaderContender(&group, payload.empty() ? id : id + "\n" + payload, None());
+    contender->contend().onAny(defer(self(), &LeaderElectionProcess::candidacy, lambda::_1));
+}
+
+void LeaderElectionProcess::candidacy(const Future<Future<Nothing> > &candidacy) {
+    if (!candidacy.isReady()) {
+        log("failed to contend: " + (candidacy.isFailed() ? candidacy.failure() : "discarded"));
+        delay(ELECTION_RETRY_INTERVAL, self(), &LeaderElectionProcess::contend);
+        return;
+    }
+
+    // Contend again once the membership is lost, e.g. to an expired
+    // session. Whether we led is up to the detector to tell.
+    candidacy.get().onAny(defer(self(), &LeaderElectionProcess::contend));
+}
+
+void LeaderElectionProcess::detect() {
+    detector.detect(leader).onAny(defer(self(), &LeaderElectionProcess::detected, lambda::_1));
+}
+
+void LeaderElectionProcess::detected(const Future<Option<Group::Membership> > &detected) {
+    if (!detected.isReady()) {
+        log("failed to detect the leader: " + (detected.isFailed() ? detected.failure() : "discarded"));
+        lead(false);
+        elect(None());
+        leader = None();
+        delay(ELECTION_RETRY_INTERVAL, self(), &LeaderElectionProcess::detect);
+        return;
+    }
+
+    leader = detected.get();
+    if (leader.isNone()) {
+        lead(false);
+        elect(None());
+    } else {
+        group.data(leader.get())
+            .onAny(defer(self(), &LeaderElectionProcess::fetched, leader.get(), lambda::_1));
+    }
+    detect();
+}
+
+void LeaderElectionProcess::fetched(const Group::Membership &fetched, const Future<Option<string> > &data) {
+    // Another election took place meanwhile, wait for its data instead.
+    if (leader.isNone() || leader.get() != fetched) {
+        return;
+    }
+    if (!data.isReady() || data.get().isNone()) {
+        lead(false);
+        elect(None());
+        return;
+    }
+    const string &joined = data.get().get();
+    size_t newline = joined.find('\n');
+    lead(joined.substr(0, newline) == id);
+    if (newline == string::npos) {
+        elect(string());
+    } else {
+        elect(joined.substr(newline + 1));
+    }
+}
+
+void LeaderElectionProcess::lead(bool _leading) {
+    if (isLeading == _leading) {
+        return;
+    }
+    isLeading = _leading;
+    log(isLeading ? "elected leader" : "no longer leading");
+    leading(isLeading);
+}
+
+void LeaderElectionProcess::elect(const Option<string> &_data) {
+    if (!elected || (electedData.isSome() && electedData.get() == _data)) {
+        return;
+    }
+    electedData = _data;
+    elected(_data);
+}
+
+LeaderElection::LeaderElection(
+        const string &servers,
+        const Duration &timeout,
+        const string &znode,
+        const std::function<void(bool)> &leading,
+        const string &data,
+        const std::function<void(const Option<string> &)> &elected) {
+    process = new LeaderElectionProcess(servers, timeout, znode, leading, data, elected);
+    spawn(process);
+}
+
+LeaderElection::~LeaderElection() {
+    terminate(process);
+    wait(process);
+    delete process;
+}
@@ -0,0 +1,38 @@
+#ifndef __SERVICE_DISCOVERY_ELECTION_HPP__
+#define __SERVICE_DISCOVERY_ELECTION_HPP__
+
+#include <functional>
+#include <string>
+
+#include <stout/duration.hpp>
+#include <stout/option.hpp>
+
+class LeaderElectionProcess;
+
+// Elects one leader among the processes taking part, wherever they
+// run, through a ZooKeeper group (see archive/contender.hpp) on a
+// session of its own. Whoever leads is told, and told again once it
+// no longer does, e.g. because its session expired. Lost candidacies
+// are renewed for as long as the election runs.
+class LeaderElection {
+public:
+    // 'leading' is called with whether this process leads, from the
+    // process of the election, whenever that changes. Candidates may
+    // join with 'data' for the others to see, e.g. where to reach them,
+    // which 'elected' is called with whenever another leader is elected,
+    // none while there is none.
+    LeaderElection(const std::string &servers,
+                   const Duration &timeout,
+                   const std::string &znode,
+                   const std::function<void(bool)> &leading,
+                   const std::string &data = "",
+                   const std::function<void(const Option<std::string> &)> &elected = nullptr);
+
+    // Withdraws from the election.
+    ~LeaderElection();
+
+private:
+    LeaderElectionProcess *process;
+};
+
+#endif // __SERVICE_DISCOVERY_ELECTION_HPP__
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <set>
+#include <utility>
+
+#include <stout/error.hpp>
+#include <stout/strings.hpp>
+
+#include "archive/url.hpp"
+#include "federation.hpp"
+#include "log.hpp"
+#include "manifest.hpp"
+#include "packed.hpp"
+
+using std::string;
+using std::vector;
+
+Try<vector<Source> > parseSources(const string &sources) {
+    vector<Source> parsed;
+    for (auto &token : strings::tokenize(sources, " \t\n")) {
+        string name = std::to_string(parsed.size());
+        string url = token;
+        size_t equals = token.find('=');
+        if (!strings::startsWith(token, zookeeper::URL::scheme()) && equals != string::npos) {
+            name = token.substr(0, equals);
+            url = token.substr(equals + 1);
+        }
+        Try<zookeeper::URL> parsedUrl = zookeeper::URL::parse(url);
+        if (parsedUrl.isError()) {
+            return Error("invalid ensemble " + token + ": " + parsedUrl.error());
+        }
+        for (auto &source : parsed) {
+            if (source.name == name) {
+                return Error("ensemble " + name + " is listed twice");
+            }
+        }
+
+        Source source;
+        source.name = name;
+        source.servers = parsedUrl.get().servers;
+        if (parsedUrl.get().path != "/") {
+            source.servers += parsedUrl.get().path;
+        }
+        source.authentication = parsedUrl.get().authentication;
+        parsed.push_back(source);
+    }
+    if (parsed.empty()) {
+        return Error("no ensembles listed");
+    }
+    return parsed;
+}
+
+// What an instance of a source is called once merged.
+static string mergedNode(const string &node, const Source &source) {
+    return node + "@" + source.name;
+}
+
+static bool byNode(const Instance &left, const Instance &right) {
+    return left.node < right.node;
+}
+
+Federation::Federation(
+        const vector<Source> &_sources,
+        Registry *_registry,
+        StateStore *_stateStore,
+        const SlowStart &_slowStart)
+        : sourceList(_sources),
+          registry(_registry),
+          stateStore(_stateStore),
+          slowStart(_slowStart),
+          packer(_slowStart),
+          snapshots(_sources.size()),
+          walked(_sources.size(), false) {
+    merged = registry->current()->unpack();
+
+    // Hand every source back what it had, under its own names.
+    std::set<string> serviceNames;
+    for (auto &service : merged.services) {
+        serviceNames.insert(service.first);
+        for (size_t i = 0; i < sourceList.size(); i++) {
+            string suffix = mergedNode("", sourceList[i]);
+            for (auto &instance : service.second.instances) {
+                if (instance.source == sourceList[i].name && strings::endsWith(instance.node, suffix)) {
+                    Instance own = instance;
+                    own.node = instance.node.substr(0, instance.node.size() - suffix.size());
+                    own.source = "";
+                    snapshots[i].services[service.first].set(own);
+                }
+            }
+        }
+    }
+    for (auto &snapshot : snapshots) {
+        snapshot.version = merged.version;
+    }
+
+    // Drops whatever no source claims, e.g. left behind while reading a
+    // single ensemble. Goes out with the first publish.
+    for (auto &serviceName : serviceNames) {
+        merge(serviceName);
+    }
+}
+
+const vector<Source> &Federation::sources() const {
+    return sourceList;
+}
+
+Snapshot Federation::initial(size_t source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return snapshots[source];
+}
+
+void Federation::publish(size_t source, const Snapshot &snapshot, const vector<Change> &sourceChanges) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::set<string> touched;
+    for (auto &change : sourceChanges) {
+        touched.insert(change.service);
+    }
+    // Only what changed is copied over, the rest is as published last.
+    // Ramp ticks thus cost nothing here, however large the registry.
+    Snapshot &known = snapshots[source];
+    known.version = snapshot.version;
+    for (auto &serviceName : touched) {
+        std::map<string, Service>::const_iterator find = snapshot.services.find(serviceName);
+        if (find == snapshot.services.end()) {
+            known.services.erase(serviceName);
+        } else {
+            known.services[serviceName] = find->second;
+        }
+        merge(serviceName);
+    }
+
+    std::shared_ptr<const PackedSnapshot> packed = packer.pack(merged, changes, wallClockMs());
+    registry->publish(packed, changes);
+    changes.clear();
+    if (stateStore != NULL) {
+        Try<Nothing> saved = stateStore->saveRegistry(*packed);
+        if (saved.isError()) {
+            log("failed to save registry: " + saved.error());
+        }
+    }
+}
+
+void Federation::markReady(size_t source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!walked[source]) {
+        log("ensemble " + sourceList[source].name + " synced");
+    }
+    walked[source] = true;
+    registry->markReady();
+}
+
+bool Federation::isSynced(size_t source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return walked[source];
+}
+
+void Federation::save() {
+    if (stateStore == NULL) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Try<Nothing> saved = stateStore->saveSnapshot(merged);
+    if (saved.isError()) {
+        log("failed to save snapshot: " + saved.error());
+    }
+}
+
+void Federation::merge(const string &serviceName) {
+    Service service;
+    bool listed = false;
+    // Endpoints taken by sources listed before.
+    std::set<std::pair<string, int> > endpoints;
+    for (size_t i = 0; i < sourceList.size(); i++) {
+        std::map<string, Service>::const_iterator find = snapshots[i].services.find(serviceName);
+        if (find == snapshots[i].services.end()) {
+            continue;
+        }
+        listed = true;
+        for (auto &instance : find->second.instances) {
+            if (!endpoints.insert(std::make_pair(instance.host, instance.port)).second) {
+                continue;
+            }
+            Instance tagged = instance;
+            tagged.node = mergedNode(instance.node, sourceList[i]);
+            tagged.source = sourceList[i].name;
+            service.instances.push_back(tagged);
+        }
+    }
+    std::sort(service.instances.begin(), service.instances.end(), byNode);
+
+    std::map<string, Service>::iterator known = merged.services.find(serviceName);
+    if (!listed) {
+        if (known != merged.services.end()) {
+            merged.services.erase(known);
+            Change change;
+            change.type = Change::REMOVED;
+            change.version = ++merged.version;
+            change.service = serviceName;
+            change.instance = Instance();
+            changes.push_back(change);
+        }
+        return;
+    }
+
+    vector<Change> diff = changesBetween(
+            known == merged.services.end() ? vector<Instance>() : known->second.instances, service.instances);
+    if (diff.empty() && known != merged.services.end()) {
+        return;
+    }
+    for (auto &change : diff) {
+        change.version = ++merged.version;
+        change.service = serviceName;
+        changes.push_back(change);
+    }
+    service.version = merged.version;
+    merged.services[serviceName] = service;
+}
@@ -0,0 +1,107 @@
+#ifndef __SERVICE_DISCOVERY_FEDERATION_HPP__
+#define __SERVICE_DISCOVERY_FEDERATION_HPP__
+
+#include <stddef.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+#include "archive/authentication.hpp"
+#include "registry.hpp"
+#include "slowstart.hpp"
+#include "state.hpp"
+
+// An ensemble to read services from, e.g. the one of a region.
+struct Source {
+    // Tags the instances read from the ensemble.
+    std::string name;
+
+    // Servers to connect to, followed by the path the nerve layout is
+    // kept under unless it is the root, see zookeeper_init().
+    std::string servers;
+
+    Option<zookeeper::Authentication> authentication;
+};
+
+// Parses whitespace separated sources of the form
+//
+//     [<name>=]zk://[<user>:<password>@]<servers>[/<path>]
+//
+// in order of priority, see Federation. Unnamed sources are named
+// after their position in the list, from 0.
+Try<std::vector<Source> > parseSources(const std::string &sources);
+
+// Merges the registries of several ensembles into the one lookups are
+// served from. Each ensemble is synced by a storage process of its own,
+// all running at once, which publish their working copy here rather
+// than to the registry.
+//
+// A service registered in several ensembles gets the instances of all
+// of them, so that picks span regions in a single lookup. Instances
+// are tagged with their source and named <node>@<source>, as nodes of
+// different ensembles are bound to collide. An endpoint registered in
+// several ensembles, e.g. while moving between them, is only kept from
+// the one listed first.
+class Federation {
+public:
+    // Starts from what 'registry' holds, e.g. loaded from the state
+    // directory. Merged snapshots are saved to 'stateStore', which may
+    // be NULL.
+    Federation(const std::vector<Source> &sources,
+               Registry *registry,
+               StateStore *stateStore,
+               const SlowStart &slowStart);
+
+    const std::vector<Source> &sources() const;
+
+    // What the storage process of a source starts from: the instances
+    // the registry holds from there, under the names they have in the
+    // ensemble.
+    Snapshot initial(size_t source);
+
+    // Merges the working copy of a source, with the changes made to it
+    // since it was published last, and publishes the result. Only the
+    // services named by the changes are read from the working copy.
+    // Called by the storage processes of the sources, from their own
+    // threads.
+    void publish(size_t source, const Snapshot &snapshot, const std::vector<Change> &changes);
+
+    // The registry turns ready once any source walked its ensemble, so
+    // that one ensemble out of reach does not hold up the others. Until
+    // theirs walk, the other sources serve what they started from. Only
+    // called after a walk that went through.
+    void markReady(size_t source);
+
+    // Whether the source walked its ensemble yet.
+    bool isSynced(size_t source);
+
+    // Saves the merged snapshot, for the next process to start from.
+    void save();
+
+private:
+    // Rebuilds a service from all sources, erasing it if none has it.
+    void merge(const std::string &serviceName);
+
+    const std::vector<Source> sourceList;
+    Registry *registry;
+    StateStore *stateStore;
+    const SlowStart slowStart;
+    Packer packer;
+
+    std::mutex mutex;
+
+    // Working copies of the sources, as last published.
+    std::vector<Snapshot> snapshots;
+    std::vector<bool> walked;
+
+    Snapshot merged;
+
+    // Made to the merged snapshot since it was published last.
+    std::vector<Change> changes;
+};
+
+#endif // __SERVICE_DISCOVERY_FEDERATION_HPP__
@@ -0,0 +1,41 @@
+#include <phpcpp.h>
+#include <time.h>
+
+#include <iostream>
+
+#include "log.hpp"
+
+using std::string;
+
+thread_local bool phpThread = false;
+
+const string currentDateTime() {
+    time_t now = time(0);
+    struct tm tstruct;
+    char buf[80];
+    localtime_r(&now, &tstruct);
+    // Visit http://en.cppreference.com/w/cpp/chrono/c/strftime
+    // for more information about date/time format
+    strftime(buf, sizeof(buf), "%Y-%m-%d.%X", &tstruct);
+
+    return buf;
+}
+
+const string getLogPrefix() {
+    return currentDateTime() + ": SERVICE_DISCOVERY: ";
+}
+
+std::ostream &logStream() {
+    if (phpThread) {
+        return Php::out;
+    }
+    return std::cerr;
+}
+
+void log(const string &message) {
+    logStream() << getLogPrefix() << message << std::endl;
+}
+
+void log(const string &serviceName, const string &nodeName, const string &message){
+    logStream() << getLogPrefix() << serviceName << ": " << nodeName << ": " << message << std::endl;
+}
@@ -0,0 +1,18 @@
+#ifndef __SERVICE_DISCOVERY_LOG_HPP__
+#define __SERVICE_DISCOVERY_LOG_HPP__
+
+#include <ostream>
+#include <string>
+
+// Set on the threads PHP calls us on. Php::out belongs to the request
+// being served, threads of our own have none (and under ZTS no
+// interpreter context either), so they log to stderr instead.
+extern thread_local bool phpThread;
+
+std::ostream &logStream();
+
+void log(const std::string &message);
+
+void log(const std::string &serviceName, const std::string &nodeName, const std::string &message);
+
+#endif // __SERVICE_DISCOVERY_LOG_HPP__
@@ -1,79 +1,843 @@
 #include <phpcpp.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
 #include <ostream>
 #include "zookeeper.hpp"
+#include "federation.hpp"
 #include "process.hpp"
+#include "random.hpp"
+#include "registry.hpp"
+#include "relay.hpp"
+#include "state.hpp"
 
 const char *Config_Servers_Key = "service-discovery.servers";
-std::map<std::string, Php::Value> services;
-ZooKeeperStorageProcess *zkProcess;
+const char *Config_State_Dir_Key = "service-discovery.state_dir";
+const char *Config_Ready_Timeout_Key = "service-discovery.ready_timeout_ms";
+const char *Config_Journal_Size_Key = "service-discovery.journal_size";
+const char *Config_Sync_Mode_Key = "service-discovery.sync_mode";
+const char *Config_Lease_Period_Key = "service-discovery.lease_period_ms";
+const char *Config_Relay_Listen_Key = "service-discovery.relay_listen";
+const char *Config_Relays_Key = "service-discovery.relays";
+const char *Config_Relay_Advertise_Key = "service-discovery.relay_advertise";
+const char *Config_Refetch_Jitter_Key = "service-discovery.refetch_jitter_ms";
+const char *Config_Refetch_Adaptive_Key = "service-discovery.refetch_adaptive";
+const char *Config_Refetch_Max_Jitter_Key = "service-discovery.refetch_max_jitter_ms";
+const char *Config_Refetch_Max_Reads_Key = "service-discovery.refetch_max_reads";
+const char *Config_Manifests_Key = "service-discovery.manifests";
+const char *Config_Slow_Start_Key = "service-discovery.slow_start_ms";
+const char *Config_Slow_Start_Floor_Key = "service-discovery.slow_start_floor_percent";
+const char *Config_Slow_Start_Interval_Key = "service-discovery.slow_start_interval_ms";
+const char *Config_Watch_Mode_Key = "service-discovery.watch_mode";
+const char *Config_Sweep_Interval_Key = "service-discovery.sweep_interval_ms";
+const char *Config_Ensembles_Key = "service-discovery.ensembles";
+const char *Config_Allow_Read_Only_Key = "service-discovery.allow_read_only";
+const char *Config_Max_Stale_Key = "service-discovery.max_stale_ms";
+const char *Config_Stale_Policy_Key = "service-discovery.stale_policy";
+Registry registry;
+StateStore *stateStore;
 
-Php::Array map2Array(std::map<string, Php::Value> &values) {
+// Whether this process keeps the registry in sync, either with the
+// ensemble or with relays. Not so for followers of the sync leader and
+// processes forked after the sync was started.
+std::atomic<bool> syncing(false);
+
+// What the sync of this process runs on. Filled in full before it is
+// published and never changed after, so request threads read it without
+// taking a lock while a follower takes over from a thread of its own.
+struct Sync {
+    // Empty unless syncing with the ensemble, one per ensemble when
+    // reading several.
+    std::vector<ZooKeeperStorageProcess *> zkProcesses;
+
+    // Merges what those read, null unless reading several ensembles.
+    Federation *federation = NULL;
+
+    // Serves hosts when this process is a relay, see relay.hpp.
+    RelayServer *relayServer = NULL;
+
+    // Null unless syncing with relays.
+    RelayClient *relayClient = NULL;
+};
+
+// Null until the sync is started, and in processes that do not sync.
+std::atomic<const Sync *> activeSync(NULL);
+
+// Whether every process syncs with the ensemble itself, or only the one
+// elected among the processes of the host, see StateStore::lead().
+enum SyncMode {
+    SYNC_PROCESS,
+    SYNC_LEADER,
+};
+
+SyncMode syncMode = SYNC_PROCESS;
+
+// How often followers try to take over from the leader.
+int64_t leasePeriodMs = 1000;
+
+// When followers may try again, in milliseconds of the steady clock.
+int64_t nextLeaseAttempt = 0;
+
+// Forked after the sync was started, never syncs again.
+bool frozen = false;
+
+// The process the sync machinery was started in, 0 until the first
+// request. Threads do not survive fork(), so under pre-forking SAPIs
+// nothing may be started in the master, and every child starts its
+// own on the first request it serves. Under ZTS the request threads of
+// a process all share the one started by whichever came first.
+std::atomic<pid_t> syncPid(0);
+std::mutex syncMutex;
+
+// How long lookups wait for the first snapshot.
+int64_t readyTimeoutMs = 0;
+
+// How long lookups are served from a registry out of sync, 0 for as
+// long as it takes.
+int64_t maxStaleMs = 0;
+
+// Whether lookups of services out of sync for longer than that fail,
+// rather than keep being served.
+bool failClosed = false;
+
+int64_t steadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SlowStart slowStartFromIni() {
+    SlowStart slowStart;
+    slowStart.windowMs = Php::ini_get(Config_Slow_Start_Key).numericValue();
+    slowStart.floor = std::min(std::max(Php::ini_get(Config_Slow_Start_Floor_Key).numericValue(), (int64_t) 0),
+                               (int64_t) 100) / 100.0;
+    slowStart.intervalMs = std::max(Php::ini_get(Config_Slow_Start_Interval_Key).numericValue(), (int64_t) 1);
+    return slowStart;
+}
+
+// What the sync is started with. Read on a request thread, as a
+// follower may take over from a thread of its own, see follow().
+struct SyncSettings {
+    std::string relays;
+    std::string servers;
+    RefetchPolicy refetchPolicy;
+    ManifestMode manifestMode;
+    WatchPolicy watchPolicy;
+    std::string ensembles;
+    bool allowReadOnly;
+    std::string relayListen;
+    std::string relayAdvertise;
+    SlowStart slowStart;
+};
+
+SyncSettings syncSettings;
+
+SyncSettings syncSettingsFromIni() {
+    SyncSettings settings;
+    settings.relays = Php::ini_get(Config_Relays_Key).stringValue();
+    settings.servers = Php::ini_get(Config_Servers_Key).stringValue();
+    settings.refetchPolicy.jitter = Milliseconds(Php::ini_get(Config_Refetch_Jitter_Key).numericValue());
+    settings.refetchPolicy.adaptive = Php::ini_get(Config_Refetch_Adaptive_Key).boolValue();
+    settings.refetchPolicy.maxJitter = Milliseconds(Php::ini_get(Config_Refetch_Max_Jitter_Key).numericValue());
+    settings.refetchPolicy.maxReads = Php::ini_get(Config_Refetch_Max_Reads_Key).numericValue();
+    settings.manifestMode = MANIFESTS_OFF;
+    std::string manifests = Php::ini_get(Config_Manifests_Key);
+    if (manifests == "read") {
+        settings.manifestMode = MANIFESTS_READ;
+    } else if (manifests == "aggregate") {
+        settings.manifestMode = MANIFESTS_AGGREGATE;
+    } else if (manifests != "off") {
+        log("unknown manifests mode " + manifests + ", not using manifests");
+    }
+    std::string watchMode = Php::ini_get(Config_Watch_Mode_Key);
+    if (watchMode == "children") {
+        settings.watchPolicy.mode = WATCH_CHILDREN;
+    } else if (watchMode != "all") {
+        log("unknown watch mode " + watchMode + ", watching all");
+    }
+    settings.watchPolicy.sweepInterval = Milliseconds(
+            std::max(Php::ini_get(Config_Sweep_Interval_Key).numericValue(), (int64_t) 1));
+    settings.ensembles = Php::ini_get(Config_Ensembles_Key).stringValue();
+    settings.allowReadOnly = Php::ini_get(Config_Allow_Read_Only_Key).boolValue();
+    settings.relayListen = Php::ini_get(Config_Relay_Listen_Key).stringValue();
+    settings.relayAdvertise = Php::ini_get(Config_Relay_Advertise_Key).stringValue();
+    settings.slowStart = slowStartFromIni();
+    return settings;
+}
+
+// Publishes what the state directory holds if it is newer than what we
+// start from, for the sync to start from there rather than from what the
+// master loaded at startup, which a recycled worker would otherwise
+// resync from all over again.
+void loadNewerState() {
+    if (stateStore == NULL) {
+        return;
+    }
+    Result<std::shared_ptr<const PackedSnapshot> > mapped = stateStore->mapRegistry();
+    if (mapped.isSome()) {
+        log("starting from " + std::to_string(mapped.get()->size()) + " services mapped anew");
+        registry.publish(mapped.get());
+        registry.markReady();
+        return;
+    }
+    Result<Snapshot> snapshot = stateStore->loadNewerSnapshot();
+    if (snapshot.isError()) {
+        log("not loading newer snapshot: " + snapshot.error());
+    } else if (snapshot.isSome()) {
+        log("starting from " + std::to_string(snapshot.get().services.size()) + " services saved since startup");
+        registry.publish(snapshot.get());
+        registry.markReady();
+    }
+}
+
+void spawnSync() {
+    const SyncSettings &settings = syncSettings;
+    loadNewerState();
+    Sync *started = new Sync();
+    if (!settings.relays.empty()) {
+        log("following relays " + settings.relays);
+        std::vector<std::string> addresses;
+        for (auto &address : split(settings.relays, ",")) {
+            if (!address.empty()) {
+                addresses.push_back(address);
+            }
+        }
+        started->relayClient = new RelayClient(addresses, &registry, stateStore, settings.slowStart);
+        started->relayClient->start();
+        activeSync = started;
+        syncing = true;
+        return;
+    }
+
+    log("starting up, connecting to servers " + settings.servers);
+    if (stateStore != NULL) {
+        // Locks are shared with whoever we were forked from, so slots
+        // are only acquired once we run in the process that owns them.
+        Try<Nothing> acquired = stateStore->acquire();
+        if (acquired.isError()) {
+            log("not resuming sessions: " + acquired.error());
+        }
+    }
+
+    if (!settings.ensembles.empty()) {
+        Try<std::vector<Source> > sources = parseSources(settings.ensembles);
+        if (sources.isError()) {
+            log("not federating: " + sources.error());
+        } else {
+            started->federation = new Federation(sources.get(), &registry, stateStore, settings.slowStart);
+        }
+    }
+    Federation *federation = started->federation;
+    if (federation != NULL) {
+        // Sessions are not resumed, the state directory only has room
+        // for one.
+        for (size_t i = 0; i < federation->sources().size(); i++) {
+            const Source &source = federation->sources()[i];
+            log("reading ensemble " + source.name + " from " + source.servers);
+            started->zkProcesses.push_back(new ZooKeeperStorageProcess(source.servers, Duration::create(60).get(), "/",
+                                                                       &registry, NULL, settings.refetchPolicy,
+                                                                       settings.manifestMode, settings.slowStart,
+                                                                       settings.watchPolicy, federation, i,
+                                                                       settings.allowReadOnly));
+        }
+    } else {
+        started->zkProcesses.push_back(new ZooKeeperStorageProcess(settings.servers, Duration::create(60).get(),
+                                                                   "/", &registry, stateStore,
+                                                                   settings.refetchPolicy, settings.manifestMode,
+                                                                   settings.slowStart, settings.watchPolicy, NULL, 0,
+                                                                   settings.allowReadOnly));
+    }
+    //initialize all values through event func
+    for (auto zkProcess : started->zkProcesses) {
+        spawn(zkProcess);
+    }
+
+    if (!settings.relayListen.empty()) {
+        RelayServer *relayServer = new RelayServer(settings.relayListen, &registry, settings.servers,
+                                                   settings.relayAdvertise);
+        Try<Nothing> listening = relayServer->start();
+        if (listening.isError()) {
+            log("not relaying: " + listening.error());
+            delete relayServer;
+        } else {
+            started->relayServer = relayServer;
+        }
+    }
+    activeSync = started;
+    syncing = true;
+}
+
+// Whether this process gets to sync. Without a state directory there is
+// nothing to elect a leader with, and if the election fails, syncing
+// more than once is better than not at all.
+bool lead() {
+    if (syncMode != SYNC_LEADER || stateStore == NULL) {
+        return true;
+    }
+    nextLeaseAttempt = steadyNowMs() + leasePeriodMs;
+    Try<bool> leading = stateStore->lead();
+    if (leading.isError()) {
+        log("syncing without a leader: " + leading.error());
+        return true;
+    }
+    return leading.get();
+}
+
+void startSync() {
+    pid_t pid = getpid();
+    if (syncPid == pid) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(syncMutex);
+    if (syncPid == pid) {
+        return;
+    }
+    if (syncPid != 0) {
+        // Forked after the sync was started (e.g. pcntl_fork), the
+        // libprocess threads are gone and cannot be brought back.
+        log("forked from " + std::to_string(syncPid.load()) + ", serving a frozen snapshot");
+        syncPid = pid;
+        // Their threads are gone along with the libprocess ones.
+        syncing = false;
+        activeSync = NULL;
+        frozen = true;
+        if (stateStore != NULL) {
+            stateStore->dropLeadership();
+        }
+        return;
+    }
+    syncPid = pid;
+    syncSettings = syncSettingsFromIni();
+
+    if (!lead()) {
+        log("following the sync leader of this host");
+        return;
+    }
+    spawnSync();
+}
+
+// Followers try to take over at most once per lease period, so once the
+// leader exits one of them syncs again within a period.
+void retryLead() {
+    std::lock_guard<std::mutex> lock(syncMutex);
+    if (syncing || frozen || steadyNowMs() < nextLeaseAttempt) {
+        return;
+    }
+    if (lead()) {
+        log("taking over as the sync leader of this host");
+        spawnSync();
+    }
+}
+
+// Picks up the registry file whenever it was swapped, for processes
+// that cannot run a sync of their own. Versions then come from the
+// process that wrote the file.
+void followRegistry() {
+    if (stateStore == NULL) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(syncMutex);
+    Result<std::shared_ptr<const PackedSnapshot> > mapped = stateStore->mapRegistry();
+    if (mapped.isError()) {
+        log("failed to map registry: " + mapped.error());
+    } else if (mapped.isSome()) {
+        registry.publish(mapped.get());
+        registry.markReady();
+    }
+}
+
+// Followers otherwise only catch up at the start of a request, which
+// long running scripts blocked in service_discovery_wait or polling the
+// notify fd may never make again. Runs once per lease period until the
+// process takes over the sync or shuts down.
+std::thread *follower = NULL;
+pid_t followerPid = 0;
+std::mutex followerMutex;
+std::condition_variable followerWake;
+bool followerStop = false;
+
+void follow() {
+    std::unique_lock<std::mutex> lock(followerMutex);
+    while (!followerStop && !syncing) {
+        followerWake.wait_for(lock, std::chrono::milliseconds(std::max(leasePeriodMs, (int64_t) 1)));
+        if (followerStop) {
+            break;
+        }
+        lock.unlock();
+        retryLead();
+        if (!syncing) {
+            followRegistry();
+        }
+        lock.lock();
+    }
+}
+
+void startFollowing() {
+    std::lock_guard<std::mutex> lock(syncMutex);
+    pid_t pid = getpid();
+    if (stateStore == NULL || frozen || followerPid == pid) {
+        return;
+    }
+    followerPid = pid;
+    follower = new std::thread(follow);
+}
+
+void stopFollowing() {
+    if (follower == NULL || followerPid != getpid()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(followerMutex);
+        followerStop = true;
+    }
+    followerWake.notify_all();
+    follower->join();
+    delete follower;
+    follower = NULL;
+}
+
+Php::Value instance2Value(const Instance &instance) {
+    Php::Value value;
+    value[CONFIG_HOST] = instance.host;
+    value[CONFIG_PORT] = instance.port;
+    value[CONFIG_NAME] = instance.name;
+    if (instance.weight >= 0) {
+        value[CONFIG_WEIGHT] = instance.weight;
+    }
+    if (!instance.source.empty()) {
+        value["source"] = instance.source;
+    }
+    return value;
+}
+
+Php::Value instance2Value(const PackedInstance &instance) {
+    Php::Value value;
+    value[CONFIG_HOST] = instance.host();
+    value[CONFIG_PORT] = instance.port();
+    value[CONFIG_NAME] = instance.name();
+    if (instance.weight() >= 0) {
+        value[CONFIG_WEIGHT] = instance.weight();
+    }
+    if (instance.source()[0] != '\0') {
+        value["source"] = instance.source();
+    }
+    return value;
+}
+
+Php::Value service2Value(const PackedService &service) {
     Php::Array array;
-    for (std::map<std::string, Php::Value>::iterator iter = values.begin(); iter != values.end(); ++iter) {
-        array[iter->first] = iter->second;
+    for (size_t i = 0; i < service.size(); i++) {
+        PackedInstance instance = service.instance(i);
+        array[instance.node()] = instance2Value(instance);
     }
     return array;
 }
 
-Php::Value next(Php::Value &service) {
-    int totalWeight = 0;
-    for (Php::Value::iterator iter = service.begin(); iter != service.end(); ++iter) {
-        if (!iter->second.contains(CONFIG_WEIGHT)) {
-            totalWeight = 0;
-            break;
+// How long the registry of this process has been out of sync, none
+// when it follows the sync leader of the host and cannot tell.
+Option<int64_t> syncStalenessMs(int64_t nowMs) {
+    const Sync *sync = activeSync;
+    if (sync == NULL) {
+        return None();
+    }
+    if (sync->relayClient != NULL) {
+        return sync->relayClient->stalenessMs(nowMs);
+    }
+    if (sync->zkProcesses.empty()) {
+        return None();
+    }
+    int64_t staleness = 0;
+    for (auto zkProcess : sync->zkProcesses) {
+        staleness = std::max(staleness, zkProcess->stalenessMs(nowMs));
+    }
+    return staleness;
+}
+
+// How long what a service was read from has been out of sync. Services
+// merged from several ensembles are as stale as the most stale one they
+// have instances from.
+Option<int64_t> serviceStalenessMs(const PackedService &service, int64_t nowMs) {
+    const Sync *sync = activeSync;
+    if (sync == NULL || sync->federation == NULL || service.size() == 0) {
+        return syncStalenessMs(nowMs);
+    }
+    int64_t staleness = 0;
+    const std::vector<Source> &sources = sync->federation->sources();
+    for (size_t i = 0; i < sources.size(); i++) {
+        for (size_t j = 0; j < service.size(); j++) {
+            if (sources[i].name == service.instance(j).source()) {
+                staleness = std::max(staleness, sync->zkProcesses[i]->stalenessMs(nowMs));
+                break;
+            }
         }
-        int weight = iter->second.get(CONFIG_WEIGHT);
-        totalWeight += weight;
     }
+    return staleness;
+}
 
-    int r = rand();
-    if (totalWeight == 0) {
-        auto step = r % service.count();
-        Php::Value::iterator iter = service.begin();
-        for(int i=0;i<step;i++){
-            iter++;
+// Whether lookups of a service fail, see service-discovery.stale_policy.
+bool tooStale(const PackedService &service) {
+    if (!failClosed || maxStaleMs <= 0) {
+        return false;
+    }
+    Option<int64_t> staleness = serviceStalenessMs(service, wallClockMs());
+    return staleness.isSome() && staleness.get() > maxStaleMs;
+}
+
+Php::Array snapshot2Array(const PackedSnapshot &snapshot) {
+    Php::Array array;
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        PackedService service = snapshot.service(i);
+        if (!tooStale(service)) {
+            array[service.name()] = service2Value(service);
         }
-        return iter->second;
     }
+    return array;
+}
 
-    int calculatedWeight = 0;
-    int i = r % totalWeight;
-    for (Php::Value::iterator iter = service.begin(); iter != service.end(); ++iter) {
-        int weight = iter->second.get(CONFIG_WEIGHT);
-        if (calculatedWeight <= i && i < calculatedWeight + weight) {
-            return iter->second;
+// What a lookup returns per service, see service_discovery_get_many().
+enum LookupMode {
+    LOOKUP_INSTANCES = 0,
+    LOOKUP_ONE = 1,
+    LOOKUP_ADDRESS = 2,
+};
+
+bool next(const PackedService &service, PackedInstance *instance) {
+    uint64_t totalWeight = service.totalWeight();
+    if (totalWeight == 0) {
+        return false;
+    }
+    *instance = service.instance(service.locate(randomBelow(totalWeight)));
+    return true;
+}
+
+// Picks up to 'n' distinct instances in weighted random order, each
+// draw weighted among the instances not drawn yet. Draws are made from
+// the total weight minus what has been drawn and then mapped onto the
+// shared weight table by skipping over the instances already drawn, so
+// nothing but the picks themselves is allocated. Costs O(n log m) for
+// the lookups plus O(n^2) for the skipping, n being small.
+std::vector<size_t> nextDistinct(const PackedService &service, size_t n) {
+    std::vector<size_t> picked;
+    // Drawn indexes in ascending order, to skip them while mapping.
+    std::vector<size_t> drawn;
+    picked.reserve(n);
+    drawn.reserve(n);
+
+    uint64_t remainingWeight = service.totalWeight();
+    while (picked.size() < n && remainingWeight > 0) {
+        uint64_t offset = randomBelow(remainingWeight);
+        for (size_t index : drawn) {
+            uint64_t start = service.locateStart(index);
+            if (start > offset) {
+                break;
+            }
+            offset += service.weightOf(index);
         }
-        calculatedWeight += weight;
+
+        size_t index = service.locate(offset);
+        picked.push_back(index);
+        drawn.insert(std::lower_bound(drawn.begin(), drawn.end(), index), index);
+        remainingWeight -= service.weightOf(index);
     }
+    return picked;
+}
 
-    return false;
+// What a request thread looks up from. Each thread keeps its own
+// reference to the snapshot and only swaps it when a new one has been
+// published, so under ZTS lookups neither take the registry lock nor
+// bump the shared reference count, and threads never write to memory
+// they share with each other.
+struct Reader {
+    uint64_t generation;
+    std::shared_ptr<const PackedSnapshot> snapshot;
+};
+
+thread_local Reader reader;
+
+// Snapshot to serve lookups from, valid until the next call on the same
+// thread. Until the first complete snapshot is in, this blocks for up
+// to service-discovery.ready_timeout_ms rather than answering from an
+// empty registry.
+const PackedSnapshot &currentSnapshot() {
+    if (!registry.isReady() && readyTimeoutMs > 0) {
+        registry.waitReady(readyTimeoutMs);
+    }
+    // Read the generation first, a publish racing with us then shows
+    // on the next call rather than being missed.
+    uint64_t generation = registry.generation();
+    if (reader.snapshot == NULL || reader.generation != generation) {
+        reader.snapshot = registry.current();
+        reader.generation = generation;
+    }
+    return *reader.snapshot;
 }
 
-Php::Value findService(std::string &serviceName) {
-    std::map<std::string, Php::Value>::iterator find = services.find(serviceName);
-    if (find != services.end()) {
-        return find->second;
+Php::Value lookup(const PackedSnapshot &snapshot, const std::string &serviceName, int mode) {
+    PackedService service;
+    if (!snapshot.find(serviceName, &service) || tooStale(service)) {
+        return false;
+    }
+    if (mode == LOOKUP_INSTANCES) {
+        return service2Value(service);
     }
 
-    return false;
+    PackedInstance instance;
+    if (!next(service, &instance)) {
+        return false;
+    }
+    if (mode == LOOKUP_ADDRESS) {
+        return std::string(instance.host()) + ":" + std::to_string(instance.port());
+    }
+    return instance2Value(instance);
 }
 
 Php::Value getService(Php::Parameters &params) {
     string serviceName = params[0];
-    return findService(serviceName);
+    return lookup(currentSnapshot(), serviceName, LOOKUP_INSTANCES);
 }
 
 Php::Value getOneService(Php::Parameters &params) {
     string serviceName = params[0];
-    Php::Value service = findService(serviceName);
-    if (service == false || service.count() == 0) {
+    return lookup(currentSnapshot(), serviceName, LOOKUP_ONE);
+}
+
+// Returns up to n distinct instances of a service for retries and
+// hedged requests, in the order they should be tried.
+Php::Value getNServices(Php::Parameters &params) {
+    string serviceName = params[0];
+    int64_t n = params[1];
+    PackedService service;
+    if (!currentSnapshot().find(serviceName, &service) || n <= 0 || tooStale(service)) {
         return false;
     }
-    return next(service);
+
+    // Never more than there are, n sizes the buffers of the draw.
+    size_t count = std::min((uint64_t) n, (uint64_t) service.size());
+    Php::Array result;
+    int i = 0;
+    for (size_t index : nextDistinct(service, count)) {
+        result[i++] = instance2Value(service.instance(index));
+    }
+    return result;
+}
+
+// Resolves a list of services in one call, all against the same
+// snapshot so the results are consistent with each other.
+Php::Value getManyServices(Php::Parameters &params) {
+    Php::Value serviceNames = params[0];
+    int mode = params.size() > 1 ? (int) params[1] : LOOKUP_INSTANCES;
+    if (mode != LOOKUP_INSTANCES && mode != LOOKUP_ONE && mode != LOOKUP_ADDRESS) {
+        throw Php::Exception("invalid lookup mode " + std::to_string(mode));
+    }
+
+    const PackedSnapshot &snapshot = currentSnapshot();
+    Php::Array result;
+    for (Php::Value::iterator iter = serviceNames.begin(); iter != serviceNames.end(); ++iter) {
+        string serviceName = iter->second;
+        result[serviceName] = lookup(snapshot, serviceName, mode);
+    }
+    return result;
 }
 
 Php::Value getAllService() {
-    return map2Array(services);
+    return snapshot2Array(currentSnapshot());
+}
+
+// Version of a service, or of the whole registry without a name. Lets
+// userland keep state derived from the registry until it changes.
+Php::Value getVersion(Php::Parameters &params) {
+    const PackedSnapshot &snapshot = currentSnapshot();
+    if (params.size() == 0) {
+        return (int64_t) snapshot.version();
+    }
+
+    string serviceName = params[0];
+    PackedService service;
+    if (!snapshot.find(serviceName, &service)) {
+        return false;
+    }
+    return (int64_t) service.version();
+}
+
+// The changes made to the registry after the given version, for long
+// running consumers to follow the registry without fetching it all.
+// When the journal no longer reaches back that far, "resync" is set
+// and the caller should start over from service_discovery_get_all()
+// and service_discovery_version().
+Php::Value getChangesSince(Php::Parameters &params) {
+    int64_t since = params[0];
+    uint64_t version;
+    std::vector<Change> changes;
+    bool complete = registry.changesSince(since < 0 ? 0 : since, &version, &changes);
+
+    Php::Array result;
+    result["version"] = (int64_t) version;
+    result["resync"] = !complete;
+    Php::Array list;
+    int i = 0;
+    for (auto &change : changes) {
+        Php::Array value;
+        value["type"] = changeType(change.type);
+        value["version"] = (int64_t) change.version;
+        value["service"] = change.service;
+        value["node"] = change.instance.node;
+        if (change.type != Change::REMOVED) {
+            value["instance"] = instance2Value(change.instance);
+        }
+        list[i++] = value;
+    }
+    result["changes"] = list;
+    return result;
+}
+
+// Blocks until a service changes past the version the caller knows,
+// or the timeout elapses, and returns its version by then. For daemons
+// without an event loop, which react to changes as they are published
+// instead of sleeping and polling.
+Php::Value waitChange(Php::Parameters &params) {
+    string serviceName = params[0];
+    int64_t since = params[1];
+    int64_t timeoutMs = params[2];
+    Option<uint64_t> version = registry.waitChange(serviceName, since < 0 ? 0 : since, timeoutMs);
+    if (version.isNone()) {
+        return false;
+    }
+    return (int64_t) version.get();
+}
+
+// A descriptor that turns readable whenever the registry changes, for
+// event loops (Swoole, ReactPHP, Amp) to wake up on. Once woken call
+// service_discovery_notify_ack(), then fetch what changed.
+Php::Value getNotifyFd() {
+    Try<int> fd = registry.notifier().fd();
+    if (fd.isError()) {
+        log("no change notifications: " + fd.error());
+        return false;
+    }
+    return fd.get();
+}
+
+Php::Value acknowledgeNotify() {
+    registry.notifier().acknowledge();
+    return true;
+}
+
+Php::Value isReady() {
+    return registry.isReady();
+}
+
+// How long the registry, or what a service was read from, has been out
+// of sync in milliseconds, 0 while in sync. Lets callers widen their
+// timeouts while served from a stale registry. False for unknown
+// services, and in processes that follow the sync leader of the host.
+Php::Value getStaleness(Php::Parameters &params) {
+    int64_t now = wallClockMs();
+    Option<int64_t> staleness = None();
+    if (params.size() == 0) {
+        staleness = syncStalenessMs(now);
+    } else {
+        string serviceName = params[0];
+        PackedService service;
+        if (!currentSnapshot().find(serviceName, &service)) {
+            return false;
+        }
+        staleness = serviceStalenessMs(service, now);
+    }
+    if (staleness.isNone()) {
+        return false;
+    }
+    return staleness.get();
+}
+
+// What the registry costs this process and the ensemble, to size
+// deployments and to compare watch modes. Never waits for the first
+// snapshot.
+Php::Value getStats() {
+    std::shared_ptr<const PackedSnapshot> snapshot = registry.current();
+    Php::Array stats;
+    stats["ready"] = registry.isReady();
+    stats["version"] = (int64_t) snapshot->version();
+    stats["services"] = (int64_t) snapshot->size();
+    stats["instances"] = (int64_t) snapshot->instanceCount();
+    stats["snapshot_bytes"] = (int64_t) snapshot->bytes();
+
+    // Read once, a follower may take over meanwhile.
+    const Sync *sync = activeSync;
+    Sync none;
+    if (sync == NULL) {
+        sync = &none;
+    }
+    const std::vector<ZooKeeperStorageProcess *> &zkProcesses = sync->zkProcesses;
+    Federation *federation = sync->federation;
+    if (!zkProcesses.empty()) {
+        stats["sync"] = "ensemble";
+    } else if (sync->relayClient != NULL) {
+        stats["sync"] = "relays";
+    } else if (frozen) {
+        stats["sync"] = "frozen";
+    } else {
+        stats["sync"] = "follower";
+    }
+
+    // Only known to the process that talks to the ensemble, summed up
+    // over all ensembles and broken down per ensemble when several.
+    int64_t now = wallClockMs();
+    bool readOnly = false;
+    if (!zkProcesses.empty()) {
+        int64_t dataWatches = 0;
+        int64_t childWatches = 0;
+        int64_t workingBytes = 0;
+        Php::Array sources;
+        Php::Array unsynced;
+        int unsyncedCount = 0;
+        for (size_t i = 0; i < zkProcesses.size(); i++) {
+            ZooKeeperStorageProcess *zkProcess = zkProcesses[i];
+            dataWatches += zkProcess->dataWatchCount();
+            childWatches += zkProcess->childWatchCount();
+            workingBytes += zkProcess->workingBytes();
+            readOnly = readOnly || zkProcess->isReadOnly();
+            if (federation != NULL) {
+                Php::Array source;
+                source["synced"] = federation->isSynced(i);
+                if (!federation->isSynced(i)) {
+                    unsynced[unsyncedCount++] = federation->sources()[i].name;
+                }
+                source["read_only"] = zkProcess->isReadOnly();
+                source["staleness_ms"] = zkProcess->stalenessMs(now);
+                source["data_watches"] = zkProcess->dataWatchCount();
+                source["child_watches"] = zkProcess->childWatchCount();
+                source["working_bytes"] = zkProcess->workingBytes();
+                sources[federation->sources()[i].name] = source;
+            }
+        }
+        stats["watch_mode"] = zkProcesses[0]->watchMode() == WATCH_CHILDREN ? "children" : "all";
+        stats["data_watches"] = dataWatches;
+        stats["child_watches"] = childWatches;
+        stats["working_bytes"] = workingBytes;
+        stats["read_only"] = readOnly;
+        if (federation != NULL) {
+            stats["sources"] = sources;
+            // Not walked yet, served from what they started from.
+            stats["unsynced_sources"] = unsynced;
+        }
+    }
+
+    Option<int64_t> staleness = syncStalenessMs(now);
+    if (staleness.isSome()) {
+        stats["staleness_ms"] = staleness.get();
+        // Served by a server cut off from the quorum, what it has may be
+        // behind however long we have been connected to it.
+        stats["stale"] = readOnly || staleness.get() > 0;
+        // Past which lookups fail or keep being served, by stale_policy.
+        if (maxStaleMs > 0) {
+            stats["max_stale_exceeded"] = staleness.get() > maxStaleMs;
+        }
+    }
+    return stats;
 }
 
 /**
@@ -104,20 +868,151 @@ PHPCPP_EXPORT void *get_module() {
             Php::ByVal("service_name", Php::Type::String, true)
     });
 
+    extension.add("service_discovery_get_n", getNServices, {
+            Php::ByVal("service_name", Php::Type::String, true),
+            Php::ByVal("n", Php::Type::Numeric, true)
+    });
+
+    extension.add("service_discovery_get_many", getManyServices, {
+            Php::ByVal("service_names", Php::Type::Array, true),
+            Php::ByVal("mode", Php::Type::Numeric, false)
+    });
+
+    extension.add(Php::Constant("SERVICE_DISCOVERY_INSTANCES", LOOKUP_INSTANCES));
+    extension.add(Php::Constant("SERVICE_DISCOVERY_ONE", LOOKUP_ONE));
+    extension.add(Php::Constant("SERVICE_DISCOVERY_ADDRESS", LOOKUP_ADDRESS));
+
+    extension.add("service_discovery_version", getVersion, {
+            Php::ByVal("service_name", Php::Type::String, false)
+    });
+
+    extension.add("service_discovery_changes_since", getChangesSince, {
+            Php::ByVal("version", Php::Type::Numeric, true)
+    });
+
+    extension.add("service_discovery_wait", waitChange, {
+            Php::ByVal("service_name", Php::Type::String, true),
+            Php::ByVal("last_version", Php::Type::Numeric, true),
+            Php::ByVal("timeout_ms", Php::Type::Numeric, true)
+    });
+
+    extension.add("service_discovery_notify_fd", getNotifyFd);
+
+    extension.add("service_discovery_notify_ack", acknowledgeNotify);
+
+    extension.add("service_discovery_ready", isReady);
+
+    extension.add("service_discovery_stats", getStats);
+
+    extension.add("service_discovery_staleness", getStaleness, {
+            Php::ByVal("service_name", Php::Type::String, false)
+    });
+
     extension.onShutdown([]() {
         Php::out << "shutting down" << std::endl;
-        services.clear();
-        delete zkProcess;
+        // Let the process save its state before it goes away, as long
+        // as it is ours to stop.
+        stopFollowing();
+        const Sync *sync = activeSync;
+        if (syncPid == getpid() && sync != NULL) {
+            activeSync = NULL;
+            delete sync->relayServer;
+            delete sync->relayClient;
+            for (auto zkProcess : sync->zkProcesses) {
+                terminate(zkProcess);
+                wait(zkProcess);
+                delete zkProcess;
+            }
+            if (sync->federation != NULL) {
+                sync->federation->save();
+                delete sync->federation;
+            }
+            delete sync;
+        }
+        delete stateStore;
+    });
+
+    extension.onRequest([]() {
+        phpThread = true;
+        startSync();
+        if (!syncing) {
+            retryLead();
+        }
+        if (!syncing) {
+            followRegistry();
+            startFollowing();
+        }
     });
 
     extension.add(Php::Ini(Config_Servers_Key, "notexists:2181"));
+    extension.add(Php::Ini(Config_State_Dir_Key, ""));
+    extension.add(Php::Ini(Config_Ready_Timeout_Key, (int64_t) 0));
+    extension.add(Php::Ini(Config_Journal_Size_Key, (int64_t) 1024));
+    extension.add(Php::Ini(Config_Sync_Mode_Key, "process"));
+    extension.add(Php::Ini(Config_Lease_Period_Key, (int64_t) 1000));
+    extension.add(Php::Ini(Config_Relay_Listen_Key, ""));
+    extension.add(Php::Ini(Config_Relays_Key, ""));
+    extension.add(Php::Ini(Config_Relay_Advertise_Key, ""));
+    extension.add(Php::Ini(Config_Refetch_Jitter_Key, (int64_t) 100));
+    extension.add(Php::Ini(Config_Refetch_Adaptive_Key, true));
+    extension.add(Php::Ini(Config_Refetch_Max_Jitter_Key, (int64_t) 5000));
+    extension.add(Php::Ini(Config_Refetch_Max_Reads_Key, (int64_t) 100));
+    extension.add(Php::Ini(Config_Manifests_Key, "off"));
+    extension.add(Php::Ini(Config_Slow_Start_Key, (int64_t) 0));
+    extension.add(Php::Ini(Config_Slow_Start_Floor_Key, (int64_t) 10));
+    extension.add(Php::Ini(Config_Slow_Start_Interval_Key, (int64_t) 1000));
+    extension.add(Php::Ini(Config_Watch_Mode_Key, "all"));
+    extension.add(Php::Ini(Config_Sweep_Interval_Key, (int64_t) 30000));
+    extension.add(Php::Ini(Config_Ensembles_Key, ""));
+    extension.add(Php::Ini(Config_Allow_Read_Only_Key, true));
+    extension.add(Php::Ini(Config_Max_Stale_Key, (int64_t) 0));
+    extension.add(Php::Ini(Config_Stale_Policy_Key, "open"));
     extension.onStartup([]() {
+        phpThread = true;
+        // This may well be the master of a pre-forking SAPI, so only
+        // load what is there. The snapshot is inherited by the children,
+        // which can serve it right away. The registry file is mapped as
+        // is, the JSON snapshot saved on shutdown is the fallback.
         std::string servers = Php::ini_get(Config_Servers_Key);
-        log("on starting up, connecting to servers " + servers);
-        zkProcess = new ZooKeeperStorageProcess(servers, Duration::create(60).get(), "/",
-                                                                       &services);
-        spawn(zkProcess);
-        //initialize all values through event func
+        std::string stateDir = Php::ini_get(Config_State_Dir_Key);
+        readyTimeoutMs = Php::ini_get(Config_Ready_Timeout_Key).numericValue();
+        maxStaleMs = Php::ini_get(Config_Max_Stale_Key).numericValue();
+        std::string stalePolicy = Php::ini_get(Config_Stale_Policy_Key);
+        if (stalePolicy == "closed") {
+            failClosed = true;
+        } else if (stalePolicy != "open") {
+            log("unknown stale policy " + stalePolicy + ", serving stale services");
+        }
+        registry.setJournalSize(Php::ini_get(Config_Journal_Size_Key).numericValue());
+        std::string mode = Php::ini_get(Config_Sync_Mode_Key);
+        if (mode == "leader") {
+            syncMode = SYNC_LEADER;
+        } else if (mode != "process") {
+            log("unknown sync mode " + mode + ", every process syncs");
+        }
+        leasePeriodMs = Php::ini_get(Config_Lease_Period_Key).numericValue();
+        stateStore = NULL;
+        if (!stateDir.empty()) {
+            stateStore = new StateStore(stateDir, servers, syncMode == SYNC_LEADER);
+            Result<std::shared_ptr<const PackedSnapshot> > mapped = stateStore->mapRegistry();
+            if (mapped.isSome()) {
+                log("mapped " + std::to_string(mapped.get()->size()) + " services from " + stateDir);
+                registry.publish(mapped.get());
+                registry.markReady();
+            } else {
+                Try<Snapshot> snapshot = stateStore->loadSnapshot();
+                if (snapshot.isSome()) {
+                    log("loaded " + std::to_string(snapshot.get().services.size()) + " services from " + stateDir);
+                    registry.publish(snapshot.get());
+                    registry.markReady();
+                }
+            }
+        }
+
+        pthread_atfork(
+                []() { registry.prepareFork(); },
+                []() { registry.afterFork(); },
+                []() { registry.afterFork(); });
     });
 
     // return the extension
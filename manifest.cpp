@@ -0,0 +1,179 @@
+#include <stdlib.h>
+
+#include <sstream>
+
+#include <stout/error.hpp>
+#include <stout/gzip.hpp>
+#include <stout/option.hpp>
+
+#include "manifest.hpp"
+
+using std::string;
+
+// Bumped whenever the layout changes, readers fall back to instance
+// znodes for manifests of another schema.
+const int MANIFEST_SCHEMA = 1;
+
+Manifest::Manifest() : version(0), sequence(-1) { }
+
+ChangelogEntry::ChangelogEntry() : base(NO_BASE), version(0) { }
+
+// Compressing can only fail for lack of memory, in which case there is
+// nothing sensible to write anyway.
+static string compress(const picojson::value &root) {
+    return gzip::compress(root.serialize()).get();
+}
+
+// Unpacks gzipped JSON of our schema.
+static Try<picojson::value> decompress(const string &data) {
+    Try<string> json = gzip::decompress(data);
+    if (json.isError()) {
+        return Error(json.error());
+    }
+
+    picojson::value root;
+    std::istringstream is(json.get());
+    string err = picojson::parse(root, is);
+    if (!err.empty()) {
+        return Error(err);
+    }
+
+    if (!root.is<picojson::object>() || !root.get("schema").is<double>()) {
+        return Error("schema not found");
+    }
+    if ((int) root.get("schema").get<double>() != MANIFEST_SCHEMA) {
+        return Error("unsupported schema " + root.get("schema").to_str());
+    }
+    return root;
+}
+
+static int64_t parseVersion(const picojson::value &value) {
+    return strtoll(value.get<string>().c_str(), NULL, 10);
+}
+
+string packManifest(const Manifest &manifest) {
+    picojson::object instances;
+    for (auto &instance : manifest.instances) {
+        instances[instance.node] = instanceToJson(instance);
+    }
+
+    picojson::object root;
+    root["schema"] = picojson::value((double) MANIFEST_SCHEMA);
+    root["version"] = picojson::value(std::to_string(manifest.version));
+    root["sequence"] = picojson::value(std::to_string(manifest.sequence));
+    root["instances"] = picojson::value(instances);
+    return compress(picojson::value(root));
+}
+
+Try<Manifest> unpackManifest(const string &data) {
+    Try<picojson::value> decompressed = decompress(data);
+    if (decompressed.isError()) {
+        return Error("invalid manifest: " + decompressed.error());
+    }
+
+    const picojson::value &root = decompressed.get();
+    if (!root.get("version").is<string>() || !root.get("instances").is<picojson::object>()) {
+        return Error("manifest version or instances not found");
+    }
+
+    Manifest manifest;
+    manifest.version = parseVersion(root.get("version"));
+    if (root.get("sequence").is<string>()) {
+        manifest.sequence = parseVersion(root.get("sequence"));
+    }
+    // Objects are ordered by key, instances come out sorted by node.
+    for (auto &node : root.get("instances").get<picojson::object>()) {
+        Try<Instance> instance = instanceFromJson(node.first, node.second);
+        if (instance.isError()) {
+            return Error(instance.error());
+        }
+        manifest.instances.push_back(instance.get());
+    }
+    return manifest;
+}
+
+string packChangelogEntry(const ChangelogEntry &entry) {
+    picojson::array changes;
+    for (auto &change : entry.changes) {
+        picojson::object value;
+        value["type"] = picojson::value(changeType(change.type));
+        value["node"] = picojson::value(change.instance.node);
+        if (change.type != Change::REMOVED) {
+            value["instance"] = instanceToJson(change.instance);
+        }
+        changes.push_back(picojson::value(value));
+    }
+
+    picojson::object root;
+    root["schema"] = picojson::value((double) MANIFEST_SCHEMA);
+    root["base"] = picojson::value(std::to_string(entry.base));
+    root["version"] = picojson::value(std::to_string(entry.version));
+    root["changes"] = picojson::value(changes);
+    return compress(picojson::value(root));
+}
+
+Try<ChangelogEntry> unpackChangelogEntry(const string &data) {
+    Try<picojson::value> decompressed = decompress(data);
+    if (decompressed.isError()) {
+        return Error("invalid changelog entry: " + decompressed.error());
+    }
+
+    const picojson::value &root = decompressed.get();
+    if (!root.get("base").is<string>() || !root.get("version").is<string>() ||
+        !root.get("changes").is<picojson::array>()) {
+        return Error("changelog entry base, version or changes not found");
+    }
+
+    ChangelogEntry entry;
+    entry.base = parseVersion(root.get("base"));
+    entry.version = parseVersion(root.get("version"));
+    for (auto &value : root.get("changes").get<picojson::array>()) {
+        Option<Change::Type> type = parseChangeType(value.get("type").to_str());
+        string node = value.get("node").to_str();
+        if (type.isNone() || node.empty()) {
+            return Error("invalid change in changelog entry");
+        }
+
+        Change change;
+        change.type = type.get();
+        if (change.type == Change::REMOVED) {
+            change.instance = Instance();
+            change.instance.node = node;
+        } else {
+            Try<Instance> instance = instanceFromJson(node, value.get("instance"));
+            if (instance.isError()) {
+                return Error(instance.error());
+            }
+            change.instance = instance.get();
+        }
+        entry.changes.push_back(change);
+    }
+    return entry;
+}
+
+std::vector<Change> changesBetween(const std::vector<Instance> &before, const std::vector<Instance> &after) {
+    std::vector<Change> changes;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < before.size() || j < after.size()) {
+        Change change;
+        if (j == after.size() || (i < before.size() && before[i].node < after[j].node)) {
+            change.type = Change::REMOVED;
+            change.instance = Instance();
+            change.instance.node = before[i++].node;
+        } else if (i == before.size() || after[j].node < before[i].node) {
+            change.type = Change::ADDED;
+            change.instance = after[j++];
+        } else {
+            bool same = sameInstance(before[i++], after[j]);
+            if (same) {
+                j++;
+                continue;
+            }
+            change.type = Change::UPDATED;
+            change.instance = after[j++];
+        }
+        changes.push_back(change);
+    }
+    return changes;
+}
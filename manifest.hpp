@@ -0,0 +1,87 @@
+#ifndef __SERVICE_DISCOVERY_MANIFEST_HPP__
+#define __SERVICE_DISCOVERY_MANIFEST_HPP__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <stout/try.hpp>
+
+#include "registry.hpp"
+
+// Manifests hold all instances of a service in a single znode, next to
+// the instance znodes nerve registers:
+//
+//     /nerve/services/<service>/services/<node>   instances, by nerve
+//     /nerve/services/<service>/manifest          manifest, by aggregators
+//
+// so that a service is fetched in one read however many instances it
+// has. A manifest is gzipped JSON:
+//
+//     {"schema": 1, "version": <version>, "sequence": <sequence>,
+//      "instances": {<node>: <instance>, ...}}
+//
+// with instances laid out as in snapshot.json. The version is the zxid
+// of the last change to the service the manifest reflects, as a decimal
+// string, so that manifests written late by a former aggregator can be
+// told from newer ones.
+//
+// Aggregators then log what changes in sequential znodes next to it,
+// rather than rewriting the whole manifest every time:
+//
+//     /nerve/services/<service>/changelog/entry-<sequence>
+//
+// Entries are gzipped JSON as well:
+//
+//     {"schema": 1, "base": <version>, "version": <version>,
+//      "changes": [{"type": "added"|"updated"|"removed", "node": <node>,
+//                   "instance": <instance>}, ...]}
+//
+// holding the changes leading from the base version of the service to
+// the next, without the instance on removal. Readers keep the sequence
+// of the last entry they applied and fetch only the entries after it,
+// from the manifest they read first on. An entry with a base other
+// than the version they have sends them back to the manifest. That is
+// how readers catch up with a new aggregator, which starts its log with
+// an entry of no base, and how those that fell behind catch up once
+// entries are gone: aggregators now and then rewrite the manifest,
+// noting the last entry it includes, and drop the entries up to there.
+struct Manifest {
+    Manifest();
+
+    int64_t version;
+
+    // Sequence of the last changelog entry included, -1 for none.
+    int64_t sequence;
+
+    // Sorted by znode name.
+    std::vector<Instance> instances;
+};
+
+std::string packManifest(const Manifest &manifest);
+
+Try<Manifest> unpackManifest(const std::string &data);
+
+// Base of the entries aggregators start a changelog with, which no
+// reader has.
+const int64_t NO_BASE = -1;
+
+struct ChangelogEntry {
+    ChangelogEntry();
+
+    int64_t base;
+    int64_t version;
+
+    // Only their type and instance are set.
+    std::vector<Change> changes;
+};
+
+std::string packChangelogEntry(const ChangelogEntry &entry);
+
+Try<ChangelogEntry> unpackChangelogEntry(const std::string &data);
+
+// What changed between two lists of instances sorted by node.
+std::vector<Change> changesBetween(const std::vector<Instance> &before, const std::vector<Instance> &after);
+
+#endif // __SERVICE_DISCOVERY_MANIFEST_HPP__
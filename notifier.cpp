@@ -0,0 +1,80 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <stout/error.hpp>
+
+#include "notifier.hpp"
+
+Notifier::Notifier() : readFd(-1), writeFd(-1), pid(0) { }
+
+Notifier::~Notifier() {
+    close();
+}
+
+void Notifier::close() {
+    if (writeFd >= 0 && writeFd != readFd) {
+        ::close(writeFd);
+    }
+    if (readFd >= 0) {
+        ::close(readFd);
+    }
+    readFd = writeFd = -1;
+}
+
+Try<int> Notifier::fd() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (readFd >= 0 && pid == getpid()) {
+        return readFd;
+    }
+    close();
+    pid = getpid();
+
+#ifdef __linux__
+    readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readFd < 0) {
+        return ErrnoError("failed to create eventfd");
+    }
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return ErrnoError("failed to create pipe");
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    readFd = fds[0];
+    writeFd = fds[1];
+#endif
+    return readFd;
+}
+
+void Notifier::notify() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (writeFd < 0 || pid != getpid()) {
+        return;
+    }
+    // A full pipe is readable already, so failures are of no concern.
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t written = write(writeFd, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t written = write(writeFd, &one, sizeof(one));
+#endif
+    (void) written;
+}
+
+void Notifier::acknowledge() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (readFd < 0 || pid != getpid()) {
+        return;
+    }
+    char buffer[512];
+    while (read(readFd, buffer, sizeof(buffer)) > 0) { }
+}
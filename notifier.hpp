@@ -0,0 +1,42 @@
+#ifndef __SERVICE_DISCOVERY_NOTIFIER_HPP__
+#define __SERVICE_DISCOVERY_NOTIFIER_HPP__
+
+#include <sys/types.h>
+
+#include <mutex>
+
+#include <stout/try.hpp>
+
+// A file descriptor which turns readable whenever something gets
+// published, for event loops to wait on instead of polling. It is an
+// eventfd where available and a pipe elsewhere, created on first use
+// so that nothing is signalled while nobody listens.
+class Notifier {
+public:
+    Notifier();
+
+    ~Notifier();
+
+    // The descriptor to wait on, readable until acknowledge() is called.
+    Try<int> fd();
+
+    void notify();
+
+    // Drains pending notifications.
+    void acknowledge();
+
+private:
+    void close();
+
+    std::mutex mutex;
+
+    // The same descriptor when backed by an eventfd.
+    int readFd;
+    int writeFd;
+
+    // Descriptors inherited over fork() are shared with the parent and
+    // would swallow its notifications, so each process opens its own.
+    pid_t pid;
+};
+
+#endif // __SERVICE_DISCOVERY_NOTIFIER_HPP__
@@ -0,0 +1,576 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <stout/error.hpp>
+
+#include "packed.hpp"
+#include "registry.hpp"
+#include "slowstart.hpp"
+
+using std::string;
+
+using packed::Header;
+using packed::InstanceRecord;
+using packed::MAGIC;
+using packed::NO_WEIGHTS;
+using packed::SCHEMA;
+using packed::ServiceRecord;
+
+PackedInstance::PackedInstance() : snapshot(NULL), record(NULL) { }
+
+PackedInstance::PackedInstance(const PackedSnapshot *_snapshot, const InstanceRecord *_record)
+        : snapshot(_snapshot),
+          record(_record) { }
+
+const char *PackedInstance::node() const {
+    return snapshot->stringAt(record->node);
+}
+
+const char *PackedInstance::host() const {
+    return snapshot->stringAt(record->host);
+}
+
+int PackedInstance::port() const {
+    return record->port;
+}
+
+const char *PackedInstance::name() const {
+    return snapshot->stringAt(record->name);
+}
+
+int PackedInstance::weight() const {
+    return record->weight;
+}
+
+int64_t PackedInstance::mzxid() const {
+    return record->mzxid;
+}
+
+int64_t PackedInstance::ctime() const {
+    return record->ctime;
+}
+
+const char *PackedInstance::source() const {
+    return snapshot->stringAt(record->source);
+}
+
+Instance PackedInstance::unpack() const {
+    Instance instance;
+    instance.node = node();
+    instance.host = host();
+    instance.port = port();
+    instance.name = name();
+    instance.weight = weight();
+    instance.mzxid = mzxid();
+    instance.ctime = ctime();
+    instance.source = source();
+    return instance;
+}
+
+PackedService::PackedService() : snapshot(NULL), record(NULL) { }
+
+PackedService::PackedService(const PackedSnapshot *_snapshot, const ServiceRecord *_record)
+        : snapshot(_snapshot),
+          record(_record) { }
+
+const char *PackedService::name() const {
+    return snapshot->stringAt(record->name);
+}
+
+uint64_t PackedService::version() const {
+    return record->version;
+}
+
+size_t PackedService::size() const {
+    return record->instanceCount;
+}
+
+PackedInstance PackedService::instance(size_t i) const {
+    const Header *header = snapshot->header();
+    const InstanceRecord *instances = (const InstanceRecord *) (snapshot->storage.get() + header->instancesOffset);
+    return PackedInstance(snapshot, &instances[record->firstInstance + i]);
+}
+
+const uint64_t *PackedService::cumulative() const {
+    if (record->weights == NO_WEIGHTS) {
+        return NULL;
+    }
+    const Header *header = snapshot->header();
+    return (const uint64_t *) (snapshot->storage.get() + header->weightsOffset) + record->weights;
+}
+
+uint64_t PackedService::totalWeight() const {
+    const uint64_t *weights = cumulative();
+    if (weights == NULL) {
+        return record->instanceCount;
+    }
+    return weights[record->instanceCount - 1];
+}
+
+uint64_t PackedService::weightOf(size_t i) const {
+    const uint64_t *weights = cumulative();
+    if (weights == NULL) {
+        return 1;
+    }
+    return i == 0 ? weights[0] : weights[i] - weights[i - 1];
+}
+
+uint64_t PackedService::locateStart(size_t i) const {
+    const uint64_t *weights = cumulative();
+    if (weights == NULL) {
+        return i;
+    }
+    return i == 0 ? 0 : weights[i - 1];
+}
+
+size_t PackedService::locate(uint64_t offset) const {
+    const uint64_t *weights = cumulative();
+    if (weights == NULL) {
+        return offset;
+    }
+    return std::upper_bound(weights, weights + record->instanceCount, offset) - weights;
+}
+
+// Collects distinct strings into the string table. Strings are only
+// kept in the table itself, the index holds their offsets.
+class StringTable {
+public:
+    StringTable() : offsets(0, Hash(&data), Equal(&data)) { }
+
+    uint32_t intern(const string &value) {
+        // Appended up front to look it up, taken back if already there.
+        uint32_t offset = data.size();
+        data.append(value.c_str(), value.size() + 1);
+        std::pair<std::unordered_set<uint32_t, Hash, Equal>::iterator, bool> inserted = offsets.insert(offset);
+        if (!inserted.second) {
+            data.resize(offset);
+        }
+        return *inserted.first;
+    }
+
+    void clear() {
+        offsets.clear();
+        data.clear();
+    }
+
+    string data;
+
+private:
+    StringTable(const StringTable &);
+
+    StringTable &operator=(const StringTable &);
+
+    // FNV-1a of the string at an offset.
+    struct Hash {
+        explicit Hash(const string *_data) : data(_data) { }
+
+        size_t operator()(uint32_t offset) const {
+            uint64_t hash = 14695981039346656037ULL;
+            for (const char *c = data->c_str() + offset; *c != '\0'; c++) {
+                hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        const string *data;
+    };
+
+    struct Equal {
+        explicit Equal(const string *_data) : data(_data) { }
+
+        bool operator()(uint32_t left, uint32_t right) const {
+            return strcmp(data->c_str() + left, data->c_str() + right) == 0;
+        }
+
+        const string *data;
+    };
+
+    std::unordered_set<uint32_t, Hash, Equal> offsets;
+};
+
+// Where the weights of a service start in 'weights', after appending
+// them, or NO_WEIGHTS when they would all be alike. Tells whether any
+// of them is ramping.
+static uint32_t packWeights(const Service &service,
+                            const SlowStart &slowStart,
+                            int64_t nowMs,
+                            std::vector<uint64_t> *weights,
+                            bool *isRamping) {
+    bool weighted = true;
+    bool ramping = false;
+    uint64_t configured = 0;
+    for (auto &instance : service.instances) {
+        if (instance.weight < 0) {
+            weighted = false;
+        } else {
+            configured += instance.weight;
+        }
+        ramping = ramping || slowStart.isRamping(instance, nowMs);
+    }
+    *isRamping = ramping;
+    weighted = weighted && configured > 0;
+    if (!weighted && !ramping) {
+        return NO_WEIGHTS;
+    }
+
+    // Instances picked alike ramp as if they all weighed one.
+    uint32_t first = weights->size();
+    uint64_t total = 0;
+    for (auto &instance : service.instances) {
+        uint64_t weight = weighted ? instance.weight : 1;
+        total += ramping ? slowStart.ramp(instance, weight, nowMs) : weight;
+        weights->push_back(total);
+    }
+    if (total == 0) {
+        weights->resize(first);
+        return NO_WEIGHTS;
+    }
+    return first;
+}
+
+static uint32_t align(uint32_t offset) {
+    return (offset + 7) & ~7;
+}
+
+std::shared_ptr<const PackedSnapshot> PackedSnapshot::pack(const Snapshot &snapshot) {
+    return pack(snapshot, SlowStart(), 0);
+}
+
+std::shared_ptr<const PackedSnapshot> PackedSnapshot::pack(const Snapshot &snapshot,
+                                                           const SlowStart &slowStart,
+                                                           int64_t nowMs) {
+    Packer packer(slowStart);
+    return packer.pack(snapshot, std::vector<Change>(), nowMs);
+}
+
+// Strings garbage may grow to before the table is built anew.
+const size_t MIN_GARBAGE = 64 * 1024;
+
+Packer::Packer(const SlowStart &_slowStart)
+        : slowStart(_slowStart),
+          strings(new StringTable()),
+          compactedSize(0) { }
+
+Packer::~Packer() {
+    delete strings;
+}
+
+std::shared_ptr<const PackedSnapshot> Packer::pack(const Snapshot &snapshot,
+                                                   const std::vector<Change> &changes,
+                                                   int64_t nowMs) {
+    bool full = previous == NULL || snapshot.version < previous->version() ||
+                strings->data.size() > 2 * compactedSize + MIN_GARBAGE;
+    if (full) {
+        strings->clear();
+        previous.reset();
+    }
+    std::set<string> changed;
+    for (auto &change : changes) {
+        changed.insert(change.service);
+    }
+
+    std::vector<ServiceRecord> services;
+    std::vector<InstanceRecord> instances;
+    std::vector<uint64_t> weights;
+    std::set<string> nowRamping;
+    services.reserve(snapshot.services.size());
+
+    // Services come out of the map sorted by name, and instances are
+    // kept sorted by node. So are the services of the previous snapshot,
+    // walked along to find those carried over.
+    size_t next = 0;
+    size_t previousCount = previous == NULL ? 0 : previous->size();
+    for (auto &service : snapshot.services) {
+        PackedService old;
+        while (next < previousCount && strcmp(previous->service(next).name(), service.first.c_str()) < 0) {
+            next++;
+        }
+        if (next < previousCount && service.first == previous->service(next).name() &&
+            changed.count(service.first) == 0 && ramping.count(service.first) == 0) {
+            old = previous->service(next);
+        }
+
+        ServiceRecord record;
+        record.firstInstance = instances.size();
+        record.instanceCount = service.second.instances.size();
+        if (old.record != NULL) {
+            // The string table of the previous snapshot is ours too.
+            record.version = old.record->version;
+            record.name = old.record->name;
+            record.weights = NO_WEIGHTS;
+            if (old.record->weights != NO_WEIGHTS) {
+                record.weights = weights.size();
+                weights.insert(weights.end(), old.cumulative(), old.cumulative() + old.record->instanceCount);
+            }
+            services.push_back(record);
+            const InstanceRecord *first = (const InstanceRecord *) (
+                    previous->storage.get() + previous->header()->instancesOffset) + old.record->firstInstance;
+            instances.insert(instances.end(), first, first + old.record->instanceCount);
+            continue;
+        }
+
+        bool serviceRamping;
+        record.version = service.second.version;
+        record.name = strings->intern(service.first);
+        record.weights = packWeights(service.second, slowStart, nowMs, &weights, &serviceRamping);
+        services.push_back(record);
+        if (serviceRamping) {
+            nowRamping.insert(service.first);
+        }
+
+        for (auto &instance : service.second.instances) {
+            InstanceRecord value;
+            value.mzxid = instance.mzxid;
+            value.ctime = instance.ctime;
+            value.node = strings->intern(instance.node);
+            value.host = strings->intern(instance.host);
+            value.name = strings->intern(instance.name);
+            value.port = instance.port;
+            value.weight = instance.weight;
+            value.source = strings->intern(instance.source);
+            instances.push_back(value);
+        }
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.schema = SCHEMA;
+    header.version = snapshot.version;
+    header.serviceCount = services.size();
+    header.instanceCount = instances.size();
+    header.weightCount = weights.size();
+    header.servicesOffset = align(sizeof(Header));
+    header.instancesOffset = align(header.servicesOffset + services.size() * sizeof(ServiceRecord));
+    header.weightsOffset = align(header.instancesOffset + instances.size() * sizeof(InstanceRecord));
+    header.stringsOffset = header.weightsOffset + weights.size() * sizeof(uint64_t);
+    header.size = header.stringsOffset + strings->data.size();
+
+    char *storage = new char[header.size]();
+    memcpy(storage, &header, sizeof(header));
+    memcpy(storage + header.servicesOffset, services.data(), services.size() * sizeof(ServiceRecord));
+    memcpy(storage + header.instancesOffset, instances.data(), instances.size() * sizeof(InstanceRecord));
+    memcpy(storage + header.weightsOffset, weights.data(), weights.size() * sizeof(uint64_t));
+    memcpy(storage + header.stringsOffset, strings->data.data(), strings->data.size());
+    std::shared_ptr<const PackedSnapshot> packed(
+            new PackedSnapshot(std::shared_ptr<const char>(storage, std::default_delete<char[]>())));
+
+    if (full) {
+        compactedSize = strings->data.size();
+    }
+    previous = packed;
+    ramping.swap(nowRamping);
+    return packed;
+}
+
+// Whether 'count' records of 'size' bytes fit in [offset, limit).
+static bool fits(uint32_t offset, uint64_t count, size_t size, uint32_t limit) {
+    return offset <= limit && count * size <= limit - offset && offset % 8 == 0;
+}
+
+// Checks a block before anything is read through its offsets, so that
+// a truncated or corrupt file fails to map rather than crashing readers.
+static Try<Nothing> validate(const char *data, size_t length) {
+    if (length < sizeof(Header)) {
+        return Error("truncated header");
+    }
+    const Header *header = (const Header *) data;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+        return Error("not a registry file");
+    }
+    if (header->schema != SCHEMA) {
+        return Error("unsupported schema " + std::to_string(header->schema));
+    }
+    if (header->size != length) {
+        return Error("size mismatch");
+    }
+    if (!fits(header->servicesOffset, header->serviceCount, sizeof(ServiceRecord), header->instancesOffset) ||
+        !fits(header->instancesOffset, header->instanceCount, sizeof(InstanceRecord), header->weightsOffset) ||
+        !fits(header->weightsOffset, header->weightCount, sizeof(uint64_t), header->stringsOffset) ||
+        header->stringsOffset > header->size ||
+        header->servicesOffset < sizeof(Header)) {
+        return Error("invalid section offsets");
+    }
+
+    // Every string ends within the table.
+    uint32_t stringsSize = header->size - header->stringsOffset;
+    if (stringsSize > 0 && data[header->size - 1] != '\0') {
+        return Error("unterminated string table");
+    }
+
+    const ServiceRecord *services = (const ServiceRecord *) (data + header->servicesOffset);
+    const InstanceRecord *instances = (const InstanceRecord *) (data + header->instancesOffset);
+    for (uint32_t i = 0; i < header->serviceCount; i++) {
+        const ServiceRecord &service = services[i];
+        if (service.name >= stringsSize ||
+            (uint64_t) service.firstInstance + service.instanceCount > header->instanceCount ||
+            (service.weights != NO_WEIGHTS &&
+             (service.instanceCount == 0 ||
+              (uint64_t) service.weights + service.instanceCount > header->weightCount))) {
+            return Error("invalid service record " + std::to_string(i));
+        }
+        // Lookups search names by bisection.
+        if (i > 0 && strcmp(data + header->stringsOffset + services[i - 1].name,
+                            data + header->stringsOffset + service.name) >= 0) {
+            return Error("service records out of order at " + std::to_string(i));
+        }
+        // Picks bisect the cumulative weights for an offset below the
+        // last one, which must land on an instance of the service.
+        if (service.weights != NO_WEIGHTS) {
+            const uint64_t *weights = (const uint64_t *) (data + header->weightsOffset) + service.weights;
+            for (uint32_t j = 1; j < service.instanceCount; j++) {
+                if (weights[j] < weights[j - 1]) {
+                    return Error("decreasing weights in service record " + std::to_string(i));
+                }
+            }
+            if (weights[service.instanceCount - 1] == 0) {
+                return Error("zero total weight in service record " + std::to_string(i));
+            }
+        }
+    }
+    for (uint32_t i = 0; i < header->instanceCount; i++) {
+        const InstanceRecord &instance = instances[i];
+        if (instance.node >= stringsSize || instance.host >= stringsSize || instance.name >= stringsSize ||
+            instance.source >= stringsSize) {
+            return Error("invalid instance record " + std::to_string(i));
+        }
+    }
+    return Nothing();
+}
+
+Try<std::shared_ptr<const PackedSnapshot> > PackedSnapshot::map(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ErrnoError("failed to open " + path);
+    }
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        ErrnoError error("failed to stat " + path);
+        close(fd);
+        return error;
+    }
+    size_t length = stat.st_size;
+    if (length == 0) {
+        close(fd);
+        return Error(path + " is empty");
+    }
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return ErrnoError("failed to map " + path);
+    }
+
+    Try<Nothing> valid = validate((const char *) data, length);
+    if (valid.isError()) {
+        munmap(data, length);
+        return Error("invalid " + path + ": " + valid.error());
+    }
+
+    // Files are renamed over, never written in place, so the mapping
+    // stays intact for as long as it is referenced.
+    std::shared_ptr<const char> storage((const char *) data, [length](const char *data) {
+        munmap((void *) data, length);
+    });
+    return std::shared_ptr<const PackedSnapshot>(new PackedSnapshot(storage));
+}
+
+Try<Nothing> PackedSnapshot::save(const string &path) const {
+    string temporary = path + "." + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return ErrnoError("failed to open " + temporary);
+    }
+    const char *data = storage.get();
+    size_t length = header()->size;
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            ErrnoError error("failed to write " + temporary);
+            close(fd);
+            unlink(temporary.c_str());
+            return error;
+        }
+        data += written;
+        length -= written;
+    }
+    close(fd);
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        ErrnoError error("failed to rename " + temporary);
+        unlink(temporary.c_str());
+        return error;
+    }
+    return Nothing();
+}
+
+PackedSnapshot::PackedSnapshot(const std::shared_ptr<const char> &_storage) : storage(_storage) { }
+
+const Header *PackedSnapshot::header() const {
+    return (const Header *) storage.get();
+}
+
+const char *PackedSnapshot::stringAt(uint32_t offset) const {
+    return storage.get() + header()->stringsOffset + offset;
+}
+
+uint64_t PackedSnapshot::version() const {
+    return header()->version;
+}
+
+size_t PackedSnapshot::size() const {
+    return header()->serviceCount;
+}
+
+size_t PackedSnapshot::instanceCount() const {
+    return header()->instanceCount;
+}
+
+size_t PackedSnapshot::bytes() const {
+    return header()->size;
+}
+
+PackedService PackedSnapshot::service(size_t i) const {
+    const ServiceRecord *services = (const ServiceRecord *) (storage.get() + header()->servicesOffset);
+    return PackedService(this, &services[i]);
+}
+
+bool PackedSnapshot::find(const string &name, PackedService *service) const {
+    const ServiceRecord *services = (const ServiceRecord *) (storage.get() + header()->servicesOffset);
+    const ServiceRecord *end = services + header()->serviceCount;
+    const ServiceRecord *iter = std::lower_bound(services, end, name,
+            [this](const ServiceRecord &record, const string &name) {
+                return strcmp(stringAt(record.name), name.c_str()) < 0;
+            });
+    if (iter == end || strcmp(stringAt(iter->name), name.c_str()) != 0) {
+        return false;
+    }
+    *service = PackedService(this, iter);
+    return true;
+}
+
+Snapshot PackedSnapshot::unpack() const {
+    Snapshot snapshot;
+    snapshot.version = version();
+    for (size_t i = 0; i < size(); i++) {
+        PackedService record = service(i);
+        Service &instances = snapshot.services[record.name()];
+        instances.version = record.version();
+        instances.instances.reserve(record.size());
+        for (size_t j = 0; j < record.size(); j++) {
+            instances.instances.push_back(record.instance(j).unpack());
+        }
+    }
+    return snapshot;
+}
@@ -0,0 +1,246 @@
+#ifndef __SERVICE_DISCOVERY_PACKED_HPP__
+#define __SERVICE_DISCOVERY_PACKED_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+#include "slowstart.hpp"
+
+struct Change;
+struct Instance;
+struct Snapshot;
+
+class PackedSnapshot;
+class StringTable;
+
+// Layout of a packed snapshot, a single block of memory holding:
+//
+//     header
+//     service records, sorted by name
+//     instance records, grouped by service and sorted by node
+//     cumulative weights of the weighted services, as ramped by slow start
+//     string table, NUL terminated strings
+//
+// Records refer to each other by index and to strings by their offset
+// into the string table. Each distinct string is stored once, however
+// many records refer to it, so a host serving dozens of services costs
+// a single copy of its name.
+//
+// Holding no pointers, the block is saved to a file as is and mapped
+// back by readers, which query it in place without parsing it. Values
+// are in host byte order, files are only shared between the processes
+// of a host. Readers refuse files of another schema.
+namespace packed {
+
+const char MAGIC[4] = {'S', 'D', 'R', 'G'};
+
+// Bumped whenever the layout changes.
+const uint32_t SCHEMA = 3;
+
+// Weights of a service whose instances are all picked alike.
+const uint32_t NO_WEIGHTS = 0xffffffff;
+
+struct Header {
+    char magic[4];
+    uint32_t schema;
+    uint64_t version;
+    uint32_t serviceCount;
+    uint32_t instanceCount;
+    uint32_t weightCount;
+    uint32_t servicesOffset;
+    uint32_t instancesOffset;
+    uint32_t weightsOffset;
+    uint32_t stringsOffset;
+    uint32_t size;
+};
+
+struct ServiceRecord {
+    uint64_t version;
+    uint32_t name;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+    // Index of the first cumulative weight, or NO_WEIGHTS.
+    uint32_t weights;
+};
+
+struct InstanceRecord {
+    int64_t mzxid;
+    int64_t ctime;
+    uint32_t node;
+    uint32_t host;
+    uint32_t name;
+    int32_t port;
+    int32_t weight;
+    uint32_t source;
+};
+
+} // namespace packed {
+
+// Views into a packed snapshot, only valid for as long as the snapshot.
+class PackedInstance {
+public:
+    PackedInstance();
+
+    PackedInstance(const PackedSnapshot *snapshot, const packed::InstanceRecord *record);
+
+    const char *node() const;
+
+    const char *host() const;
+
+    int port() const;
+
+    const char *name() const;
+
+    // Negative when the instance config carries no weight.
+    int weight() const;
+
+    int64_t mzxid() const;
+
+    int64_t ctime() const;
+
+    // Empty unless merged from several ensembles.
+    const char *source() const;
+
+    Instance unpack() const;
+
+private:
+    const PackedSnapshot *snapshot;
+    const packed::InstanceRecord *record;
+};
+
+class PackedService {
+public:
+    PackedService();
+
+    PackedService(const PackedSnapshot *snapshot, const packed::ServiceRecord *record);
+
+    const char *name() const;
+
+    // Version of the registry this service last changed in.
+    uint64_t version() const;
+
+    size_t size() const;
+
+    PackedInstance instance(size_t i) const;
+
+    // Instances are picked by weight when all of them carry one and not
+    // all of them weigh zero, otherwise as if they all weighed one. Either
+    // way weights are ramped for instances in slow start.
+    uint64_t totalWeight() const;
+
+    uint64_t weightOf(size_t i) const;
+
+    // Offset in [0, totalWeight()) where the weight of instance i starts.
+    uint64_t locateStart(size_t i) const;
+
+    // Index of the instance covering 'offset' in [0, totalWeight()).
+    size_t locate(uint64_t offset) const;
+
+private:
+    friend class Packer;
+
+    const uint64_t *cumulative() const;
+
+    const PackedSnapshot *snapshot;
+    const packed::ServiceRecord *record;
+};
+
+// An immutable snapshot packed for lookups. It is allocated in one go
+// and released the same way, however many services and instances it
+// holds.
+class PackedSnapshot {
+public:
+    static std::shared_ptr<const PackedSnapshot> pack(const Snapshot &snapshot);
+
+    // Packs weights as ramped by 'slowStart' at 'nowMs'.
+    static std::shared_ptr<const PackedSnapshot> pack(const Snapshot &snapshot,
+                                                      const SlowStart &slowStart,
+                                                      int64_t nowMs);
+
+    // Maps a snapshot saved to 'path', after checking that all of its
+    // offsets stay within the file.
+    static Try<std::shared_ptr<const PackedSnapshot> > map(const std::string &path);
+
+    // Writes the snapshot to a file of its own and renames it over
+    // 'path', so that readers only ever map complete snapshots.
+    Try<Nothing> save(const std::string &path) const;
+
+    uint64_t version() const;
+
+    // Number of services.
+    size_t size() const;
+
+    // Number of instances, of all services.
+    size_t instanceCount() const;
+
+    // Size of the block, as allocated or mapped.
+    size_t bytes() const;
+
+    PackedService service(size_t i) const;
+
+    bool find(const std::string &name, PackedService *service) const;
+
+    Snapshot unpack() const;
+
+private:
+    friend class PackedInstance;
+    friend class PackedService;
+    friend class Packer;
+
+    explicit PackedSnapshot(const std::shared_ptr<const char> &storage);
+
+    const packed::Header *header() const;
+
+    const char *stringAt(uint32_t offset) const;
+
+    // Either allocated or mapped, released as a whole.
+    std::shared_ptr<const char> storage;
+};
+
+// Packs the snapshots a working copy goes through, one after the other.
+// Only the services that changed since the previous one, or whose
+// weights ramp, are packed again. The records of the others are copied
+// over as they are, along with the string table they refer to, so a
+// change costs about a copy of the block rather than interning every
+// string of the registry again. Strings no longer referred to pile up
+// in the table until it doubles, then everything is packed anew.
+class Packer {
+public:
+    explicit Packer(const SlowStart &slowStart = SlowStart());
+
+    ~Packer();
+
+    // Packs 'snapshot', which 'changes' led to from the snapshot packed
+    // last, with weights as ramped at 'nowMs'.
+    std::shared_ptr<const PackedSnapshot> pack(const Snapshot &snapshot,
+                                               const std::vector<Change> &changes,
+                                               int64_t nowMs);
+
+private:
+    Packer(const Packer &);
+
+    Packer &operator=(const Packer &);
+
+    const SlowStart slowStart;
+
+    // Strings of the snapshot packed last, and those of its predecessors.
+    StringTable *strings;
+
+    // Size of the table when it was last built from scratch.
+    size_t compactedSize;
+
+    std::shared_ptr<const PackedSnapshot> previous;
+
+    // Services whose weights were ramping as of the snapshot packed last.
+    std::set<std::string> ramping;
+};
+
+#endif // __SERVICE_DISCOVERY_PACKED_HPP__
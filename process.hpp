@@ -19,18 +19,27 @@
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h> // For ArrayInputStream.
 
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <queue>
 #include <set>
 #include <string>
 #include <vector>
 
+#include <process/defer.hpp>
+#include <process/delay.hpp>
 #include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/process.hpp>
 
 #include <stout/duration.hpp>
 #include <stout/error.hpp>
+#include <stout/lambda.hpp>
 #include <stout/none.hpp>
+#include <stout/numify.hpp>
 #include <stout/option.hpp>
 #include <stout/result.hpp>
 #include <stout/some.hpp>
@@ -38,6 +47,16 @@
 #include <stout/try.hpp>
 #include <stout/uuid.hpp>
 
+#include "config.hpp"
+#include "election.hpp"
+#include "federation.hpp"
+#include "log.hpp"
+#include "manifest.hpp"
+#include "random.hpp"
+#include "registry.hpp"
+#include "slowstart.hpp"
+#include "staleness.hpp"
+#include "state.hpp"
 #include "watcher.hpp"
 #include "zookeeper.hpp"
 
@@ -50,10 +69,77 @@ using std::string;
 using std::vector;
 
 const string SERVICE_PATH_PREFIX = "/nerve/services";
-const string CONFIG_HOST = "host";
-const string CONFIG_PORT = "port";
-const string CONFIG_NAME = "name";
-const string CONFIG_WEIGHT = "weight";
+
+// Group in which aggregators elect the one writing manifests.
+const string AGGREGATOR_GROUP_PATH = "/nerve/aggregators";
+
+const string CHANGELOG_ENTRY_PREFIX = "entry-";
+
+// Changelog entries written before the manifest is rewritten and the
+// entries dropped.
+const int CHANGELOG_COMPACT_EVERY = 64;
+
+// How often readers check that the manifests they read keep up. Every
+// manifest is given up on while no aggregator is elected. Whether each
+// is behind its service costs a read, so every check only takes its
+// share of them, all of them being checked over MANIFEST_CHECK_ROUNDS.
+// One found behind is checked again the next time, and given up on if
+// it still is.
+const Duration MANIFEST_CHECK_INTERVAL = Seconds(5);
+const int MANIFEST_CHECK_ROUNDS = 12;
+
+// How refetches are spread out once a watch fired. Every client
+// watching a popular service sees it fire at the same moment, and
+// would otherwise hit the ensemble all at once.
+struct RefetchPolicy {
+    RefetchPolicy();
+
+    // Refetches wait for a random delay of up to this long, during
+    // which further changes to the same service are coalesced.
+    Duration jitter;
+
+    // Whether the jitter widens as reads slow down, up to maxJitter.
+    bool adaptive;
+    Duration maxJitter;
+
+    // Reads issued per refetch round, the rest waits for the next
+    // round. Zero for no limit.
+    int maxReads;
+};
+
+// Which znodes we leave watches on. The ensemble holds every watch for
+// as long as the session lasts, one per instance adds up to a lot once
+// thousands of clients watch tens of thousands of instances.
+enum WatchMode {
+    // Services for instances coming and going, and instances for
+    // changes to their data.
+    WATCH_ALL,
+    // Services only. Instances whose data changed are found by sweeping
+    // over all of them now and then, see sweep().
+    WATCH_CHILDREN,
+};
+
+struct WatchPolicy {
+    WatchPolicy();
+
+    WatchMode mode;
+
+    // How long a sweep over all instances takes, in WATCH_CHILDREN mode.
+    // Each tick of the sweep checks its share of them.
+    Duration sweepInterval;
+};
+
+// What to do with manifests, see manifest.hpp.
+enum ManifestMode {
+    // Read instance znodes only.
+    MANIFESTS_OFF,
+    // Read services from their manifest where there is one, from their
+    // instance znodes otherwise.
+    MANIFESTS_READ,
+    // Read instance znodes, and write manifests from them while elected
+    // among the aggregators.
+    MANIFESTS_AGGREGATE,
+};
 
 class ZooKeeperStorageProcess : public Process<ZooKeeperStorageProcess> {
 public:
@@ -61,33 +147,157 @@ public:
             const string &servers,
             const Duration &timeout,
             const string &znode,
-            std::map<std::string, Php::Value> *services);
+            Registry *registry,
+            StateStore *stateStore,
+            const RefetchPolicy &refetchPolicy = RefetchPolicy(),
+            ManifestMode manifestMode = MANIFESTS_OFF,
+            const SlowStart &slowStart = SlowStart(),
+            const WatchPolicy &watchPolicy = WatchPolicy(),
+            Federation *federation = NULL,
+            size_t source = 0,
+            bool allowReadOnly = false);
 
     virtual ~ZooKeeperStorageProcess();
 
     virtual void initialize();
 
+    virtual void finalize();
+
     void addNewNode(const string &serviceName, const string &path);
 
     void removeNode(const string &path);
 
     void addNewService(const string &path);
 
+    // Picks up services added or removed since last listed, false if
+    // they could not be listed.
+    bool refreshServices();
+
+    void dropVanishedServices(const vector<string> &serviceNames);
+
+    void dropVanishedInstances(const string &serviceName, const vector<string> &childs);
+
+    // Re-reads an instance whose data changed.
+    void refreshNode(const string &path);
+
+    void addServiceInstances(const string &path);
+
+    // Brings the service up to date from its manifest and changelog,
+    // false if it has no manifest we can read, in which case we are
+    // told once one is written.
+    bool syncManifest(const string &serviceName);
+
+    bool readManifest(const string &serviceName);
+
+    void applyManifest(const string &serviceName, const Manifest &manifest);
+
+    // Applies the changelog entries after the ones we have, false if
+    // they don't follow on what we have.
+    bool readChangelog(const string &serviceName);
+
+    void applyChangelogEntry(const string &serviceName, const ChangelogEntry &entry);
+
+    // Gives up on manifests that fell behind, and returns to those that
+    // caught up again, see MANIFEST_CHECK_INTERVAL.
+    void checkManifests();
+
+    // Reads the service from its instance znodes until its manifest
+    // catches up.
+    void fallBack(const string &serviceName, const string &reason);
+
+    // Whether the manifest reflects the instances the service has now.
+    bool isManifestCurrent(const string &serviceName);
+
+    // Whether this process leads the aggregators, called by the election.
+    void aggregate(bool leading);
+
+    void writeManifests();
+
+    // The manifest of the service as it is now, none if it went away.
+    Option<Manifest> buildManifest(const string &serviceName, const Service &service);
+
+    bool writeManifest(const string &serviceName, const Manifest &manifest);
+
+    bool startChangelog(const string &serviceName, const Manifest &manifest);
+
+    bool appendChangelog(const string &serviceName, const Manifest &manifest);
+
+    Option<int64_t> writeChangelogEntry(const string &serviceName, const ChangelogEntry &entry);
+
+    void compactChangelog(const string &serviceName);
+
+    bool isCurrent(const string &serviceName, const string &path);
+
+    void scheduleRefetch();
+
+    Duration refetchJitter();
+
+    void refetch();
+
+    bool refetchPath(const string &path, int *reads);
+
+    bool refetchChildren(const string &path, int *reads);
+
+    void record(Change::Type type, const string &serviceName, const Instance &instance);
+
+    void publish();
+
+    // Republishes to settle the weights of ramping instances.
+    void ramp();
+
+    // Checks the next share of instances for changes to their data,
+    // while they are not watched.
+    void sweep();
+
+    // Watches left on the ensemble by this session. Safe to call from
+    // any thread.
+    int64_t dataWatchCount() const;
+
+    int64_t childWatchCount() const;
+
+    // Rough size of the working copy as of the last publish. Safe to
+    // call from any thread.
+    int64_t workingBytes() const;
+
+    WatchMode watchMode() const;
+
+    // Whether we are connected to a server cut off from the quorum,
+    // whose data may be behind. Safe to call from any thread.
+    bool isReadOnly() const;
+
+    // How long the working copy has been out of sync with the ensemble
+    // by 'nowMs', 0 while it is not. Safe to call from any thread.
+    int64_t stalenessMs(int64_t nowMs) const;
+
     // ZooKeeper events.
     // Note that events from previous sessions are dropped.
     void connected(int64_t sessionId, bool reconnect);
 
+    void connectedReadOnly(int64_t sessionId);
+
     void reconnecting(int64_t sessionId);
 
     void expired(int64_t sessionId);
 
     void updated(int64_t sessionId, const string &path);
 
+    void changed(int64_t sessionId, const string &path);
+
     void created(int64_t sessionId, const string &path);
 
     void deleted(int64_t sessionId, const string &path);
 
 private:
+    // Reads the registry from scratch once connected.
+    void walk();
+
+    // Keeps track of the watches we set, see dataWatchCount().
+    void watchedData(const string &path);
+
+    void watchedChildren(const string &path);
+
+    void countWatches();
+
     const string servers;
 
     // The session timeout requested by the client.
@@ -97,7 +307,95 @@ private:
 
     Watcher *watcher;
     ZooKeeper *zk;
-    std::map<std::string, Php::Value> *services;
+
+    // Working copy of the registry, published after every change.
+    Snapshot snapshot;
+
+    // Changes made to the working copy since it was last published.
+    vector<Change> changes;
+    Registry *registry;
+
+    // Where the session and the snapshot are kept across restarts, may
+    // be NULL.
+    StateStore *stateStore;
+
+    const RefetchPolicy refetchPolicy;
+
+    // Paths whose children changed, waiting for the next refetch round.
+    std::set<string> pending;
+    bool refetchScheduled;
+
+    const ManifestMode manifestMode;
+
+    // Services read from their manifest, along with the version and
+    // the changelog sequence we are at.
+    std::map<string, Manifest> manifests;
+
+    // Services whose manifest was behind on the last check.
+    std::set<string> lagging;
+
+    // Where the checks are at, the last manifest checked and the last
+    // service checked for whether its manifest caught up.
+    string checkedManifest;
+    string checkedFallback;
+
+    // Services read from their instances as their manifest fell behind.
+    std::set<string> fellBack;
+
+    // Out of sync while any manifest we read is behind.
+    Staleness manifestStaleness;
+
+    // Only while aggregating.
+    LeaderElection *election;
+    bool aggregating;
+
+    // What we last wrote of a service while aggregating.
+    struct Aggregate {
+        // Version of the service in the working copy.
+        uint64_t version;
+
+        // The service as of the last changelog entry.
+        Manifest manifest;
+
+        // Entries written since the manifest was.
+        int entries;
+    };
+    std::map<string, Aggregate> aggregated;
+
+    const SlowStart slowStart;
+    bool rampScheduled;
+
+    // Packs the working copy for the registry, see publish().
+    Packer packer;
+
+    const WatchPolicy watchPolicy;
+
+    // Set when reading one of several ensembles, what we publish is
+    // merged there with the others rather than published as is.
+    Federation *federation;
+    const size_t source;
+
+    // Whether sessions may settle for read-only servers while there is
+    // no quorum, rather than serve nothing new at all.
+    const bool allowReadOnly;
+    std::atomic<bool> readOnly;
+
+    // Only a complete walk over a read-write session confirms what we
+    // have, read-only servers may be behind themselves.
+    Staleness staleness;
+
+    // Paths we hold a watch on, until it fires or the session expires.
+    // The ensemble keeps a single watch of a kind per path, however
+    // often it is set.
+    std::set<string> dataWatches;
+    std::set<string> childWatches;
+    std::atomic<int64_t> dataWatchTotal;
+    std::atomic<int64_t> childWatchTotal;
+    std::atomic<int64_t> workingTotal;
+
+    // Where the sweep is at, the last instance it checked.
+    string sweptService;
+    string sweptNode;
 
     // ZooKeeper connection state.
     enum State {
@@ -107,79 +405,60 @@ private:
     } state;
 };
 
+RefetchPolicy::RefetchPolicy()
+        : jitter(Duration::zero()),
+          adaptive(false),
+          maxJitter(Duration::zero()),
+          maxReads(0) { }
+
+WatchPolicy::WatchPolicy()
+        : mode(WATCH_ALL),
+          sweepInterval(Seconds(30)) { }
+
 ZooKeeperStorageProcess::ZooKeeperStorageProcess(
         const string &_servers,
         const Duration &_timeout,
         const string &_znode,
-        std::map<std::string, Php::Value> *_services)
+        Registry *_registry,
+        StateStore *_stateStore,
+        const RefetchPolicy &_refetchPolicy,
+        ManifestMode _manifestMode,
+        const SlowStart &_slowStart,
+        const WatchPolicy &_watchPolicy,
+        Federation *_federation,
+        size_t _source,
+        bool _allowReadOnly)
         : servers(_servers),
           timeout(_timeout),
           znode(strings::remove(_znode, "/", strings::SUFFIX)),
           watcher(NULL),
           zk(NULL),
-          services(_services),
+          registry(_registry),
+          stateStore(_stateStore),
+          refetchPolicy(_refetchPolicy),
+          refetchScheduled(false),
+          manifestMode(_manifestMode),
+          election(NULL),
+          aggregating(false),
+          slowStart(_slowStart),
+          rampScheduled(false),
+          packer(_slowStart),
+          watchPolicy(_watchPolicy),
+          federation(_federation),
+          source(_source),
+          allowReadOnly(_allowReadOnly),
+          readOnly(false),
+          dataWatchTotal(0),
+          childWatchTotal(0),
+          workingTotal(0),
           state(DISCONNECTED) { }
 
 ZooKeeperStorageProcess::~ZooKeeperStorageProcess() {
+    delete election;
     delete zk;
     delete watcher;
 }
 
-const string currentDateTime() {
-    time_t now = time(0);
-    struct tm tstruct;
-    char buf[80];
-    tstruct = *localtime(&now);
-    // Visit http://en.cppreference.com/w/cpp/chrono/c/strftime
-    // for more information about date/time format
-    strftime(buf, sizeof(buf), "%Y-%m-%d.%X", &tstruct);
-
-    return buf;
-}
-
-const string getLogPrefix() {
-    return currentDateTime() + ": SERVICE_DISCOVERY: ";
-}
-
-void log(const string &message) {
-    Php::out << getLogPrefix() << message << std::endl;
-}
-
-void log(const string &serviceName, const string &nodeName, const string &message){
-    Php::out << getLogPrefix() << serviceName << ": " << nodeName << ": " << message << std::endl;
-}
-
-Php::Value parseConfig(const string &instanceConfig) {
-    picojson::value value;
-    Php::Value configValue;
-    std::istringstream is(instanceConfig);
-    string err = picojson::parse(value, is);
-    if (err.empty()) {
-        if (!value.contains(CONFIG_HOST) || !value.contains(CONFIG_PORT)) {
-            string message = "config host or port is not found, skipping";
-            log(message);
-            return message;
-        }
-        configValue[CONFIG_HOST] = value.get(CONFIG_HOST).to_str();
-        picojson::value port = value.get(CONFIG_PORT);
-        if (port.is<int>()) {
-            configValue[CONFIG_PORT] = (int) value.get(CONFIG_PORT).get<double>();
-        } else {
-            string message = "invalid config value port, skipping this instance";
-            log(message);
-            return message;
-        }
-        configValue[CONFIG_NAME] = value.get(CONFIG_NAME).to_str();
-        picojson::value weight = value.get(CONFIG_WEIGHT);
-        if (weight.is<int>()) {
-            configValue[CONFIG_WEIGHT] = (int) weight.get<double>();
-        }
-        return configValue;
-    }
-
-    return err;
-}
-
 vector<string> split(const string &input, string delim) {
     vector<string> tokens;
     auto start = 0U;
@@ -204,12 +483,51 @@ string getNodeName(const string &path) {
     return tokens.back();
 }
 
-const int SERVICE_PATH_DEPTH = 3;
-const int SERVICE_NODE_PATH_DEPTH = 5;
+string getServicePath(const string &serviceName) {
+    return SERVICE_PATH_PREFIX + "/" + serviceName + "/services";
+}
+
+string getManifestPath(const string &serviceName) {
+    return SERVICE_PATH_PREFIX + "/" + serviceName + "/manifest";
+}
+
+bool isManifestPath(const string &path) {
+    auto tokens = split(path, "/");
+    return tokens.size() == 5 && tokens[4] == "manifest";
+}
+
+string getChangelogPath(const string &serviceName) {
+    return SERVICE_PATH_PREFIX + "/" + serviceName + "/changelog";
+}
+
+bool isChangelogPath(const string &path) {
+    auto tokens = split(path, "/");
+    return tokens.size() == 5 && tokens[4] == "changelog";
+}
+
+// Sequence of a changelog entry, from the name of its znode.
+Option<int64_t> getChangelogSequence(const string &entry) {
+    if (!strings::startsWith(entry, CHANGELOG_ENTRY_PREFIX)) {
+        return None();
+    }
+    Try<int64_t> sequence = numify<int64_t>(entry.substr(CHANGELOG_ENTRY_PREFIX.size()));
+    if (sequence.isError()) {
+        return None();
+    }
+    return sequence.get();
+}
+
+// Tokens of service and instance paths, counting the empty one in front
+// of the leading slash:
+//
+//     /nerve/services/<service>/services
+//     /nerve/services/<service>/services/<node>
+const int SERVICE_PATH_DEPTH = 5;
+const int SERVICE_NODE_PATH_DEPTH = 6;
 
 bool isServicePath(const string &path) {
     auto tokens = split(path, "/");
-    if (tokens.size() == SERVICE_PATH_DEPTH) {
+    if (tokens.size() == SERVICE_PATH_DEPTH && tokens[4] == "services") {
         return true;
     }
 
@@ -218,61 +536,328 @@ bool isServicePath(const string &path) {
 
 bool isNodePath(const string &path) {
     auto tokens = split(path, "/");
-    if (tokens.size() == SERVICE_NODE_PATH_DEPTH) {
+    if (tokens.size() == SERVICE_NODE_PATH_DEPTH && tokens[4] == "services") {
         return true;
     }
 
     return false;
 }
 
+// How often a sweep checks its next share of instances.
+const Duration SWEEP_TICK = Seconds(1);
+
+// Rough size of a working copy, counting its strings and records but
+// not what the allocator adds.
+int64_t approximateBytes(const Snapshot &snapshot) {
+    int64_t bytes = sizeof(Snapshot);
+    for (auto &service : snapshot.services) {
+        bytes += sizeof(service) + service.first.capacity() +
+                 service.second.instances.capacity() * sizeof(Instance);
+        for (auto &instance : service.second.instances) {
+            bytes += instance.node.capacity() + instance.host.capacity() + instance.name.capacity();
+        }
+    }
+    return bytes;
+}
+
 void ZooKeeperStorageProcess::initialize() {
+    // Start from whatever was published before us, e.g. the snapshot
+    // left behind by the previous process on this host.
+    snapshot = federation != NULL ? federation->initial(source) : registry->current()->unpack();
+
     // Doing initialization here allows to avoid the race between
     // instantiating the ZooKeeper instance and being spawned ourself.
     watcher = new ProcessWatcher<ZooKeeperStorageProcess>(self());
-    zk = new ZooKeeper(servers, timeout, watcher);
+    Option<clientid_t> clientId = None();
+    if (stateStore != NULL) {
+        clientId = stateStore->loadSession();
+    }
+    if (clientId.isSome()) {
+        log("resuming session " + std::to_string(clientId.get().client_id));
+        zk = new ZooKeeper(servers, timeout, watcher, &clientId.get(), allowReadOnly);
+    } else {
+        zk = new ZooKeeper(servers, timeout, watcher, NULL, allowReadOnly);
+    }
+
+    if (manifestMode == MANIFESTS_AGGREGATE) {
+        election = new LeaderElection(servers, timeout, AGGREGATOR_GROUP_PATH,
+                                      defer(self(), &ZooKeeperStorageProcess::aggregate, lambda::_1));
+    }
+
+    if (watchPolicy.mode == WATCH_CHILDREN) {
+        delay(SWEEP_TICK, self(), &ZooKeeperStorageProcess::sweep);
+    }
+
+    if (manifestMode == MANIFESTS_READ) {
+        manifestStaleness.confirm();
+        delay(MANIFEST_CHECK_INTERVAL, self(), &ZooKeeperStorageProcess::checkManifests);
+    }
+}
+
+void ZooKeeperStorageProcess::finalize() {
+    // Let another aggregator take over right away.
+    delete election;
+    election = NULL;
+
+    if (stateStore == NULL) {
+        return;
+    }
+
+    Try<Nothing> saved = stateStore->saveSnapshot(snapshot);
+    if (saved.isError()) {
+        log("failed to save snapshot: " + saved.error());
+    }
+
+    // Leave the session open for the next process to resume.
+    zk->detach();
 }
 
 void ZooKeeperStorageProcess::removeNode(const string &path) {
     auto serviceName = getServiceName(path);
-    std::map<string, Php::Value>::iterator find = services->find(serviceName);
-    if (find == services->end()) {
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find == snapshot.services.end()) {
         return;
     } else {
         auto nodeName = getNodeName(path);
-        find->second.unset(nodeName);
-        log(serviceName, nodeName, "removed");
+        if (find->second.erase(nodeName)) {
+            log(serviceName, nodeName, "removed");
+            Instance removed = Instance();
+            removed.node = nodeName;
+            record(Change::REMOVED, serviceName, removed);
+        }
     }
 }
 
 void ZooKeeperStorageProcess::addNewNode(const string &serviceName, const string &path) {
     string config;
-    int code = zk->get(path, true, &config, NULL);
+    Stat stat;
+    bool watch = watchPolicy.mode == WATCH_ALL;
+    int code = zk->get(path, watch, &config, &stat);
     if (code == ZOK) {
-        Php::Value configValue = parseConfig(config);
+        if (watch) {
+            watchedData(path);
+        }
+        Try<Instance> instance = parseConfig(config);
         auto nodeName = getNodeName(path);
-        if (configValue.isString()) {
-            log(serviceName, nodeName,  "instance config is invalid json");
+        if (instance.isError()) {
+            log(serviceName, nodeName, "instance config is invalid: " + instance.error());
         } else {
-            log(serviceName, nodeName, "added " + config);
-            std::map<string, Php::Value>::iterator find = services->find(serviceName);
-            if (find == services->end()) {
-                Php::Array instances;
-                instances.set(nodeName, configValue);
-                (*services)[serviceName] = instances;
-            } else {
-                find->second.set(nodeName, configValue);
+            instance.get().node = nodeName;
+            instance.get().mzxid = stat.mzxid;
+            instance.get().ctime = stat.ctime;
+            Service &service = snapshot.services[serviceName];
+            const Instance *known = service.find(nodeName);
+            if (known != NULL && sameInstance(*known, instance.get())) {
+                return;
+            }
+            log(serviceName, nodeName, (known == NULL ? "added " : "updated ") + config);
+            Change::Type type = known == NULL ? Change::ADDED : Change::UPDATED;
+            service.set(instance.get());
+            record(type, serviceName, instance.get());
+        }
+    }
+}
+
+// Moves the registry to a new version, which the service is now at as
+// well, and journals the change that led there.
+void ZooKeeperStorageProcess::record(Change::Type type, const string &serviceName, const Instance &instance) {
+    snapshot.version++;
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find != snapshot.services.end()) {
+        find->second.version = snapshot.version;
+    }
+
+    Change change;
+    change.type = type;
+    change.version = snapshot.version;
+    change.service = serviceName;
+    change.instance = instance;
+    changes.push_back(change);
+}
+
+void ZooKeeperStorageProcess::publish() {
+    int64_t now = wallClockMs();
+    if (federation != NULL) {
+        federation->publish(source, snapshot, changes);
+    } else {
+        std::shared_ptr<const PackedSnapshot> packed = packer.pack(snapshot, changes, now);
+        registry->publish(packed, changes);
+        // Also for readers outside the process (CLI tools, sidecars) to map.
+        if (stateStore != NULL) {
+            Try<Nothing> saved = stateStore->saveRegistry(*packed);
+            if (saved.isError()) {
+                log("failed to save registry: " + saved.error());
+            }
+        }
+    }
+    changes.clear();
+    workingTotal = approximateBytes(snapshot);
+
+    if (aggregating && state == CONNECTED) {
+        writeManifests();
+    }
+
+    // Ramped weights only move on with the next publish, which comes
+    // by timer should nothing change meanwhile. The one after the ramp
+    // ends settles the full weights.
+    if (!rampScheduled && slowStart.isRamping(snapshot, now)) {
+        rampScheduled = true;
+        delay(Milliseconds(slowStart.intervalMs), self(), &ZooKeeperStorageProcess::ramp);
+    }
+}
+
+void ZooKeeperStorageProcess::ramp() {
+    rampScheduled = false;
+    publish();
+}
+
+// Without data watches, instances are checked in turns by their stat,
+// a share of them per tick, and only those whose data changed since we
+// read them are read again. Changes thus show within a sweep interval,
+// at the cost of a steady trickle of reads instead of a watch each.
+void ZooKeeperStorageProcess::sweep() {
+    delay(SWEEP_TICK, self(), &ZooKeeperStorageProcess::sweep);
+    if (state != CONNECTED) {
+        return;
+    }
+
+    size_t total = 0;
+    for (auto &service : snapshot.services) {
+        total += service.second.size();
+    }
+    double ticks = std::max(watchPolicy.sweepInterval.ms() / SWEEP_TICK.ms(), 1.0);
+    size_t share = (size_t) ceil(total / ticks);
+
+    size_t checked = 0;
+    // Removed once the walk over the map is done, not to pull instances
+    // out from under it.
+    vector<string> vanished;
+    std::map<string, Service>::iterator service = snapshot.services.lower_bound(sweptService);
+    for (; service != snapshot.services.end() && checked < share; ++service) {
+        // Kept up to date by their changelog instead.
+        if (manifests.count(service->first) > 0) {
+            continue;
+        }
+        const vector<Instance> &instances = service->second.instances;
+        vector<Instance>::const_iterator instance = instances.begin();
+        if (service->first == sweptService) {
+            instance = std::upper_bound(instances.begin(), instances.end(), sweptNode,
+                                        [](const string &node, const Instance &instance) {
+                                            return node < instance.node;
+                                        });
+        }
+        for (; instance != instances.end() && checked < share; ++instance) {
+            checked++;
+            sweptService = service->first;
+            sweptNode = instance->node;
+            string path = getServicePath(service->first) + "/" + instance->node;
+            Stat stat;
+            int code = zk->exists(path, false, &stat);
+            if (code == ZOK && stat.mzxid != instance->mzxid) {
+                pending.insert(path);
+            } else if (code == ZNONODE) {
+                vanished.push_back(path);
             }
         }
     }
+    if (checked < share) {
+        // Went all the way round, start over next tick.
+        sweptService.clear();
+        sweptNode.clear();
+    }
+    for (auto &path : vanished) {
+        removeNode(path);
+    }
+    if (!vanished.empty()) {
+        publish();
+    }
+    scheduleRefetch();
+}
+
+int64_t ZooKeeperStorageProcess::dataWatchCount() const {
+    return dataWatchTotal;
+}
+
+int64_t ZooKeeperStorageProcess::childWatchCount() const {
+    return childWatchTotal;
+}
+
+int64_t ZooKeeperStorageProcess::workingBytes() const {
+    return workingTotal;
+}
+
+WatchMode ZooKeeperStorageProcess::watchMode() const {
+    return watchPolicy.mode;
+}
+
+bool ZooKeeperStorageProcess::isReadOnly() const {
+    return readOnly;
+}
+
+int64_t ZooKeeperStorageProcess::stalenessMs(int64_t nowMs) const {
+    return std::max(staleness.ms(nowMs), manifestStaleness.ms(nowMs));
+}
+
+void ZooKeeperStorageProcess::watchedData(const string &path) {
+    dataWatches.insert(path);
+    countWatches();
+}
+
+void ZooKeeperStorageProcess::watchedChildren(const string &path) {
+    childWatches.insert(path);
+    countWatches();
+}
+
+void ZooKeeperStorageProcess::countWatches() {
+    dataWatchTotal = dataWatches.size();
+    childWatchTotal = childWatches.size();
+}
+
+// Whether the cached copy of an instance is still up to date, in which
+// case we only need to re-arm its watch, if any, rather than fetch its
+// data.
+bool ZooKeeperStorageProcess::isCurrent(const string &serviceName, const string &path) {
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find == snapshot.services.end()) {
+        return false;
+    }
+    const Instance *instance = find->second.find(getNodeName(path));
+    if (instance == NULL) {
+        return false;
+    }
+
+    Stat stat;
+    bool watch = watchPolicy.mode == WATCH_ALL;
+    int code = zk->exists(path, watch, &stat);
+    if (watch && (code == ZOK || code == ZNONODE)) {
+        watchedData(path);
+    }
+    return code == ZOK && stat.mzxid == instance->mzxid;
 }
 
 void ZooKeeperStorageProcess::addNewService(const string &path) {
+    string serviceName = getServiceName(path);
+    if (manifestMode == MANIFESTS_READ && fellBack.count(serviceName) == 0 && syncManifest(serviceName)) {
+        return;
+    }
+    addServiceInstances(path);
+}
+
+// Reads the service from its instance znodes, watching all of them.
+void ZooKeeperStorageProcess::addServiceInstances(const string &path) {
     vector<string> childs;
     int code = zk->getChildren(path, true, &childs);
     string serviceName = getServiceName(path);
     if (code == ZOK) {
+        watchedChildren(path);
+        // Drop cached instances that went away while nobody watched.
+        dropVanishedInstances(serviceName, childs);
+
         for (auto &child : childs) {
-            addNewNode(serviceName, path + "/" + child);
+            string nodePath = path + "/" + child;
+            if (!isCurrent(serviceName, nodePath)) {
+                addNewNode(serviceName, nodePath);
+            }
         }
     }
 }
@@ -281,23 +866,538 @@ void ZooKeeperStorageProcess::connected(int64_t sessionId, bool reconnect) {
     if (sessionId != zk->getSessionId()) {
         return;
     }
-    log("connected, initilizing config values...");
+    if (readOnly) {
+        log("quorum is back, reading from a read-write server again");
+        readOnly = false;
+    } else {
+        log("connected, initilizing config values...");
+    }
+    if (stateStore != NULL) {
+        Try<Nothing> saved = stateStore->saveSession(zk->getClientId());
+        if (saved.isError()) {
+            log("failed to save session: " + saved.error());
+        }
+    }
+    walk();
+}
+
+// Read-only servers serve reads and watches as usual, what they have
+// is merely as of when they lost the quorum. Their sessions are only
+// known to them, so they are not saved for the next process to resume.
+void ZooKeeperStorageProcess::connectedReadOnly(int64_t sessionId) {
+    if (sessionId != zk->getSessionId()) {
+        return;
+    }
+    log("connected to a read-only server, serving what it has until the quorum is back");
+    readOnly = true;
+    staleness.lapse();
+    walk();
+}
+
+void ZooKeeperStorageProcess::walk() {
+    if (federation != NULL && federation->sources()[source].authentication.isSome()) {
+        const zookeeper::Authentication &authentication = federation->sources()[source].authentication.get();
+        int code = zk->authenticate(authentication.scheme, authentication.credentials);
+        if (code != ZOK) {
+            log("failed to authenticate with " + federation->sources()[source].name + ": " + zk->message(code));
+        }
+    }
+
+    // The walk refetches everything, including what is pending.
+    pending.clear();
+
     //get all service config
     vector<string> serviceNames;
     int code;
     code = zk->getChildren(SERVICE_PATH_PREFIX, true, &serviceNames);
     if (code == ZOK) {
+        watchedChildren(SERVICE_PATH_PREFIX);
+        dropVanishedServices(serviceNames);
+
         //init the global config object here
         for (auto &serviceName : serviceNames) {
-            string servicePath = SERVICE_PATH_PREFIX + "/" + serviceName + "/services";
-            addNewService(servicePath);
-            }
-//            (*services)[serviceName] = instances;
+            addNewService(getServicePath(serviceName));
+        }
+        publish();
     } else {
         log("no config values found on path " + SERVICE_PATH_PREFIX);
-        log("using cached config file from runtime folder");
+        log("keeping " + std::to_string(snapshot.services.size()) + " cached services");
     };
+    // Nothing more is coming, don't keep lookups waiting either way.
+    // Unless other ensembles may still come through, which a source
+    // that failed to walk its own is left to.
+    if (federation != NULL) {
+        if (code == ZOK || code == ZNONODE) {
+            federation->markReady(source);
+        }
+    } else {
+        registry->markReady();
+    }
     state = CONNECTED;
+    if (!readOnly && (code == ZOK || code == ZNONODE)) {
+        staleness.confirm();
+    }
+
+    if (aggregating) {
+        writeManifests();
+    }
+}
+
+bool ZooKeeperStorageProcess::syncManifest(const string &serviceName) {
+    if (manifests.count(serviceName) > 0 && readChangelog(serviceName)) {
+        return true;
+    }
+
+    // First read, or the changelog no longer follows on what we have.
+    if (!readManifest(serviceName)) {
+        return false;
+    }
+    if (!readChangelog(serviceName)) {
+        log(serviceName, "", "changelog does not follow on the manifest, waiting for the next entry");
+    }
+    return true;
+}
+
+bool ZooKeeperStorageProcess::readManifest(const string &serviceName) {
+    // Changes come through the changelog, which is watched instead.
+    string path = getManifestPath(serviceName);
+    string data;
+    Stat stat;
+    int code = zk->get(path, false, &data, &stat);
+    if (code == ZNONODE) {
+        manifests.erase(serviceName);
+        // Ask to be told once the manifest is written.
+        code = zk->exists(path, true, &stat);
+        if (code == ZOK || code == ZNONODE) {
+            watchedData(path);
+        }
+        if (code == ZOK) {
+            pending.insert(path);
+            scheduleRefetch();
+        }
+        return false;
+    }
+    if (code != ZOK) {
+        log(serviceName, "", "failed to read manifest: " + zk->message(code));
+        manifests.erase(serviceName);
+        return false;
+    }
+
+    Try<Manifest> manifest = unpackManifest(data);
+    if (manifest.isError()) {
+        log(serviceName, "", manifest.error());
+        manifests.erase(serviceName);
+        return false;
+    }
+
+    std::map<string, Manifest>::iterator known = manifests.find(serviceName);
+    if (known != manifests.end() && manifest.get().version < known->second.version) {
+        // Written late by a former aggregator, the next one is coming.
+        log(serviceName, "", "ignoring manifest older than the one read before");
+        return true;
+    }
+    Manifest &current = manifests[serviceName];
+    current.version = manifest.get().version;
+    current.sequence = manifest.get().sequence;
+    applyManifest(serviceName, manifest.get());
+    return true;
+}
+
+void ZooKeeperStorageProcess::applyManifest(const string &serviceName, const Manifest &manifest) {
+    Service &service = snapshot.services[serviceName];
+    std::set<string> listed;
+    for (auto &instance : manifest.instances) {
+        listed.insert(instance.node);
+    }
+    for (vector<Instance>::iterator iter = service.instances.begin(); iter != service.instances.end();) {
+        if (listed.count(iter->node) == 0) {
+            log(serviceName, iter->node, "removed");
+            Instance removed = Instance();
+            removed.node = iter->node;
+            iter = service.instances.erase(iter);
+            record(Change::REMOVED, serviceName, removed);
+        } else {
+            ++iter;
+        }
+    }
+
+    for (auto &instance : manifest.instances) {
+        const Instance *known = service.find(instance.node);
+        if (known == NULL || !sameInstance(*known, instance)) {
+            Change::Type type = known == NULL ? Change::ADDED : Change::UPDATED;
+            service.set(instance);
+            record(type, serviceName, instance);
+        }
+    }
+}
+
+bool ZooKeeperStorageProcess::readChangelog(const string &serviceName) {
+    string path = getChangelogPath(serviceName);
+    vector<string> entries;
+    int code = zk->getChildren(path, true, &entries);
+    if (code != ZOK) {
+        log(serviceName, "", "failed to read changelog: " + zk->message(code));
+        // Nothing to watch, at least learn about rewrites.
+        Stat stat;
+        int watched = zk->exists(getManifestPath(serviceName), true, &stat);
+        if (watched == ZOK || watched == ZNONODE) {
+            watchedData(getManifestPath(serviceName));
+        }
+        return code == ZNONODE;
+    }
+    watchedChildren(path);
+
+    std::map<int64_t, string> ordered;
+    for (auto &entry : entries) {
+        Option<int64_t> sequence = getChangelogSequence(entry);
+        if (sequence.isSome()) {
+            ordered[sequence.get()] = entry;
+        }
+    }
+
+    Manifest &current = manifests[serviceName];
+    for (std::map<int64_t, string>::iterator iter = ordered.upper_bound(current.sequence);
+         iter != ordered.end(); ++iter) {
+        string data;
+        Stat stat;
+        code = zk->get(path + "/" + iter->second, false, &data, &stat);
+        if (code != ZOK) {
+            // Dropped meanwhile, the manifest has it by now.
+            return false;
+        }
+        Try<ChangelogEntry> entry = unpackChangelogEntry(data);
+        if (entry.isError()) {
+            log(serviceName, iter->second, entry.error());
+            return false;
+        }
+
+        if (entry.get().version > current.version) {
+            if (entry.get().base != current.version) {
+                return false;
+            }
+            applyChangelogEntry(serviceName, entry.get());
+            current.version = entry.get().version;
+        }
+        current.sequence = iter->first;
+    }
+    return true;
+}
+
+void ZooKeeperStorageProcess::applyChangelogEntry(const string &serviceName, const ChangelogEntry &entry) {
+    Service &service = snapshot.services[serviceName];
+    for (auto &change : entry.changes) {
+        const string &node = change.instance.node;
+        if (change.type == Change::REMOVED) {
+            if (service.erase(node)) {
+                log(serviceName, node, "removed");
+                record(Change::REMOVED, serviceName, change.instance);
+            }
+        } else {
+            const Instance *known = service.find(node);
+            if (known == NULL || !sameInstance(*known, change.instance)) {
+                Change::Type type = known == NULL ? Change::ADDED : Change::UPDATED;
+                service.set(change.instance);
+                record(type, serviceName, change.instance);
+            }
+        }
+    }
+}
+
+void ZooKeeperStorageProcess::checkManifests() {
+    delay(MANIFEST_CHECK_INTERVAL, self(), &ZooKeeperStorageProcess::checkManifests);
+    if (state != CONNECTED) {
+        return;
+    }
+
+    // Nobody keeps the manifests up to date without an aggregator.
+    vector<string> aggregators;
+    int code = zk->getChildren(AGGREGATOR_GROUP_PATH, false, &aggregators);
+    if (code != ZOK && code != ZNONODE) {
+        return;
+    }
+    bool aggregated = code == ZOK && !aggregators.empty();
+
+    // Collected first, falling back changes what we walk.
+    vector<string> behind;
+    std::set<string> stillLagging;
+    if (!aggregated) {
+        for (auto &manifest : manifests) {
+            behind.push_back(manifest.first);
+        }
+    } else {
+        for (auto &serviceName : lagging) {
+            if (manifests.count(serviceName) > 0 && !isManifestCurrent(serviceName)) {
+                behind.push_back(serviceName);
+            }
+        }
+        size_t share = std::min((size_t) ceil(manifests.size() / (double) MANIFEST_CHECK_ROUNDS), manifests.size());
+        std::map<string, Manifest>::iterator manifest = manifests.upper_bound(checkedManifest);
+        for (size_t i = 0; i < share; i++, ++manifest) {
+            if (manifest == manifests.end()) {
+                manifest = manifests.begin();
+            }
+            checkedManifest = manifest->first;
+            if (lagging.count(manifest->first) == 0 && !isManifestCurrent(manifest->first)) {
+                stillLagging.insert(manifest->first);
+            }
+        }
+    }
+    for (auto &serviceName : behind) {
+        fallBack(serviceName, aggregated ? "manifest fell behind" : "no aggregator elected");
+    }
+    lagging.swap(stillLagging);
+    if (lagging.empty()) {
+        manifestStaleness.confirm();
+    } else {
+        manifestStaleness.lapse();
+    }
+
+    if (aggregated) {
+        // Taken in turns as well, a new aggregator takes a while to
+        // write them all.
+        vector<string> caughtUp;
+        size_t share = std::min((size_t) ceil(fellBack.size() / (double) MANIFEST_CHECK_ROUNDS), fellBack.size());
+        std::set<string>::iterator serviceName = fellBack.upper_bound(checkedFallback);
+        for (size_t i = 0; i < share; i++, ++serviceName) {
+            if (serviceName == fellBack.end()) {
+                serviceName = fellBack.begin();
+            }
+            checkedFallback = *serviceName;
+            if (snapshot.services.count(*serviceName) == 0 || isManifestCurrent(*serviceName)) {
+                caughtUp.push_back(*serviceName);
+            }
+        }
+        for (auto &serviceName : caughtUp) {
+            fellBack.erase(serviceName);
+            if (snapshot.services.count(serviceName) > 0 && syncManifest(serviceName)) {
+                log(serviceName, "", "manifest caught up, reading it again");
+            }
+        }
+    }
+
+    if (!changes.empty()) {
+        publish();
+    }
+}
+
+void ZooKeeperStorageProcess::fallBack(const string &serviceName, const string &reason) {
+    log(serviceName, "", reason + ", reading instances");
+    manifests.erase(serviceName);
+    lagging.erase(serviceName);
+    fellBack.insert(serviceName);
+    addServiceInstances(getServicePath(serviceName));
+}
+
+// Manifests are versioned by the last zxid of the service they reflect,
+// which is at least the zxid instances were last added or removed in.
+// Instances changing in place go unnoticed until the next such change.
+bool ZooKeeperStorageProcess::isManifestCurrent(const string &serviceName) {
+    Stat stat;
+    if (zk->exists(getServicePath(serviceName), false, &stat) != ZOK) {
+        return true;
+    }
+    std::map<string, Manifest>::iterator known = manifests.find(serviceName);
+    if (known != manifests.end()) {
+        return known->second.version >= stat.pzxid;
+    }
+
+    string data;
+    Stat manifestStat;
+    if (zk->get(getManifestPath(serviceName), false, &data, &manifestStat) != ZOK) {
+        return false;
+    }
+    Try<Manifest> manifest = unpackManifest(data);
+    return manifest.isSome() && manifest.get().version >= stat.pzxid;
+}
+
+void ZooKeeperStorageProcess::aggregate(bool leading) {
+    aggregating = leading;
+    // Whoever wrote meanwhile, we start over.
+    aggregated.clear();
+    if (aggregating && state == CONNECTED) {
+        writeManifests();
+    }
+}
+
+void ZooKeeperStorageProcess::writeManifests() {
+    // Nothing can be written without a quorum.
+    if (readOnly) {
+        return;
+    }
+    for (auto &service : snapshot.services) {
+        std::map<string, Aggregate>::iterator written = aggregated.find(service.first);
+        if (written != aggregated.end() && written->second.version == service.second.version) {
+            continue;
+        }
+
+        Option<Manifest> manifest = buildManifest(service.first, service.second);
+        if (manifest.isNone()) {
+            continue;
+        }
+        bool logged = written == aggregated.end()
+                      ? startChangelog(service.first, manifest.get())
+                      : appendChangelog(service.first, manifest.get());
+        if (logged) {
+            aggregated[service.first].version = service.second.version;
+        }
+    }
+}
+
+Option<Manifest> ZooKeeperStorageProcess::buildManifest(const string &serviceName, const Service &service) {
+    // Instances come and go with the children of the service, and
+    // change with their own znode, the last of either is the version.
+    Stat stat;
+    int code = zk->exists(getServicePath(serviceName), false, &stat);
+    if (code != ZOK) {
+        return None();
+    }
+    Manifest manifest;
+    manifest.version = stat.pzxid;
+    for (auto &instance : service.instances) {
+        manifest.version = std::max(manifest.version, instance.mzxid);
+    }
+    manifest.instances = service.instances;
+    return manifest;
+}
+
+bool ZooKeeperStorageProcess::writeManifest(const string &serviceName, const Manifest &manifest) {
+    string path = getManifestPath(serviceName);
+    string data = packManifest(manifest);
+    int code = zk->set(path, data, -1);
+    if (code == ZNONODE) {
+        code = zk->create(path, data, ZOO_OPEN_ACL_UNSAFE, 0, NULL);
+    }
+    if (code != ZOK) {
+        log(serviceName, "", "failed to write manifest: " + zk->message(code));
+        return false;
+    }
+    return true;
+}
+
+// Writes the manifest a first time since we lead, then an entry of no
+// base, sending readers that followed someone else back to it.
+bool ZooKeeperStorageProcess::startChangelog(const string &serviceName, const Manifest &manifest) {
+    string path = getChangelogPath(serviceName);
+    int code = zk->create(path, "", ZOO_OPEN_ACL_UNSAFE, 0, NULL);
+    vector<string> entries;
+    if (code == ZOK || code == ZNODEEXISTS) {
+        code = zk->getChildren(path, false, &entries);
+    }
+    if (code != ZOK) {
+        log(serviceName, "", "failed to read changelog: " + zk->message(code));
+        return false;
+    }
+
+    Aggregate aggregate;
+    aggregate.manifest = manifest;
+    aggregate.entries = entries.size();
+    for (auto &entry : entries) {
+        Option<int64_t> sequence = getChangelogSequence(entry);
+        if (sequence.isSome()) {
+            aggregate.manifest.sequence = std::max(aggregate.manifest.sequence, sequence.get());
+        }
+    }
+    if (!writeManifest(serviceName, aggregate.manifest)) {
+        return false;
+    }
+
+    ChangelogEntry entry;
+    entry.version = manifest.version;
+    if (writeChangelogEntry(serviceName, entry).isNone()) {
+        return false;
+    }
+    aggregate.entries++;
+    aggregated[serviceName] = aggregate;
+    return true;
+}
+
+bool ZooKeeperStorageProcess::appendChangelog(const string &serviceName, const Manifest &manifest) {
+    Aggregate &aggregate = aggregated[serviceName];
+    ChangelogEntry entry;
+    entry.base = aggregate.manifest.version;
+    // Versions only tell entries apart, make sure they move on.
+    entry.version = std::max(manifest.version, entry.base + 1);
+    entry.changes = changesBetween(aggregate.manifest.instances, manifest.instances);
+
+    Option<int64_t> sequence = writeChangelogEntry(serviceName, entry);
+    if (sequence.isNone()) {
+        return false;
+    }
+    aggregate.manifest.version = entry.version;
+    aggregate.manifest.sequence = sequence.get();
+    aggregate.manifest.instances = manifest.instances;
+    if (++aggregate.entries >= CHANGELOG_COMPACT_EVERY) {
+        compactChangelog(serviceName);
+    }
+    return true;
+}
+
+Option<int64_t> ZooKeeperStorageProcess::writeChangelogEntry(const string &serviceName, const ChangelogEntry &entry) {
+    string created;
+    int code = zk->create(getChangelogPath(serviceName) + "/" + CHANGELOG_ENTRY_PREFIX,
+                          packChangelogEntry(entry), ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE, &created);
+    if (code != ZOK) {
+        log(serviceName, "", "failed to write changelog entry: " + zk->message(code));
+        return None();
+    }
+    return getChangelogSequence(getNodeName(created));
+}
+
+// Rewrites the manifest as of the last entry, and drops the entries up
+// to there.
+void ZooKeeperStorageProcess::compactChangelog(const string &serviceName) {
+    Aggregate &aggregate = aggregated[serviceName];
+    if (!writeManifest(serviceName, aggregate.manifest)) {
+        return;
+    }
+    aggregate.entries = 0;
+
+    string path = getChangelogPath(serviceName);
+    vector<string> entries;
+    if (zk->getChildren(path, false, &entries) != ZOK) {
+        return;
+    }
+    for (auto &entry : entries) {
+        Option<int64_t> sequence = getChangelogSequence(entry);
+        if (sequence.isSome() && sequence.get() <= aggregate.manifest.sequence) {
+            zk->remove(path + "/" + entry, -1);
+        } else {
+            aggregate.entries++;
+        }
+    }
+}
+
+// Forgets cached services which no longer exist.
+void ZooKeeperStorageProcess::dropVanishedServices(const vector<string> &serviceNames) {
+    std::set<string> alive(serviceNames.begin(), serviceNames.end());
+    for (std::map<string, Service>::iterator iter = snapshot.services.begin(); iter != snapshot.services.end();) {
+        if (alive.count(iter->first) == 0) {
+            log(iter->first, "", "removed");
+            string serviceName = iter->first;
+            iter = snapshot.services.erase(iter);
+            record(Change::REMOVED, serviceName, Instance());
+        } else {
+            ++iter;
+        }
+    }
+}
+
+bool ZooKeeperStorageProcess::refreshServices() {
+    vector<string> serviceNames;
+    int code = zk->getChildren(SERVICE_PATH_PREFIX, true, &serviceNames);
+    if (code != ZOK) {
+        log("failed to list services: " + zk->message(code));
+        return false;
+    }
+    watchedChildren(SERVICE_PATH_PREFIX);
+
+    dropVanishedServices(serviceNames);
+    for (auto &serviceName : serviceNames) {
+        if (snapshot.services.count(serviceName) == 0) {
+            addNewService(getServicePath(serviceName));
+        }
+    }
+    return true;
 }
 
 void ZooKeeperStorageProcess::reconnecting(int64_t sessionId) {
@@ -306,6 +1406,7 @@ void ZooKeeperStorageProcess::reconnecting(int64_t sessionId) {
     }
     log("session dropped, reconnecting...");
     state = CONNECTING;
+    staleness.lapse();
 }
 
 void ZooKeeperStorageProcess::expired(int64_t sessionId) {
@@ -315,33 +1416,227 @@ void ZooKeeperStorageProcess::expired(int64_t sessionId) {
 
     log("session expired, trying new session...");
     state = DISCONNECTED;
+    readOnly = false;
+    staleness.lapse();
+    if (stateStore != NULL) {
+        stateStore->clearSession();
+    }
+    // Gone along with the session.
+    dataWatches.clear();
+    childWatches.clear();
+    countWatches();
 
     delete zk;
-    zk = new ZooKeeper(servers, timeout, watcher);
+    zk = new ZooKeeper(servers, timeout, watcher, NULL, allowReadOnly);
 
     state = CONNECTING;
 }
 
+// Children of 'path' changed.
 void ZooKeeperStorageProcess::updated(int64_t sessionId, const string &path) {
+    if (sessionId != zk->getSessionId()) {
+        return;
+    }
     log("node " + path + " updated");
+    childWatches.erase(path);
+    countWatches();
+    pending.insert(path);
+    scheduleRefetch();
+}
+
+// Data of 'path' changed, e.g. the weight or port of an instance.
+void ZooKeeperStorageProcess::changed(int64_t sessionId, const string &path) {
+    if (sessionId != zk->getSessionId()) {
+        return;
+    }
+    log("node " + path + " changed");
+    dataWatches.erase(path);
+    countWatches();
+    if (isNodePath(path) || (isManifestPath(path) && manifestMode == MANIFESTS_READ)) {
+        pending.insert(path);
+        scheduleRefetch();
+    }
+}
+
+void ZooKeeperStorageProcess::scheduleRefetch() {
+    if (refetchScheduled || pending.empty()) {
+        return;
+    }
+    refetchScheduled = true;
+    Duration jitter = refetchJitter();
+    delay(Milliseconds(randomBelow((uint64_t) jitter.ms() + 1)), self(), &ZooKeeperStorageProcess::refetch);
+}
+
+// Latency of the ensemble while it is not under pressure. The adaptive
+// jitter widens by how many times slower reads are than that.
+const double HEALTHY_READ_LATENCY_MS = 10;
+
+Duration ZooKeeperStorageProcess::refetchJitter() {
+    Duration jitter = refetchPolicy.jitter;
+    if (refetchPolicy.adaptive) {
+        double slowdown = zk->getLatency().ms() / HEALTHY_READ_LATENCY_MS;
+        if (slowdown > 1) {
+            jitter = jitter * slowdown;
+        }
+        if (jitter > refetchPolicy.maxJitter) {
+            jitter = refetchPolicy.maxJitter;
+        }
+    }
+    return jitter;
+}
+
+void ZooKeeperStorageProcess::refetch() {
+    refetchScheduled = false;
+    // Paths coming up meanwhile wait for the next round.
+    std::set<string> round;
+    round.swap(pending);
+    int reads = 0;
+    for (std::set<string>::iterator iter = round.begin(); iter != round.end(); ++iter) {
+        if (!refetchPath(*iter, &reads)) {
+            // Out of reads, picked up again next round.
+            pending.insert(iter, round.end());
+            break;
+        }
+    }
+    // Idle rounds neither wake readers nor rewrite the registry file.
+    // Ramping weights move on by their own timer, see publish().
+    if (!changes.empty()) {
+        publish();
+    }
+    scheduleRefetch();
+}
+
+bool ZooKeeperStorageProcess::refetchPath(const string &path, int *reads) {
+    if (path == SERVICE_PATH_PREFIX) {
+        (*reads)++;
+        refreshServices();
+        return true;
+    }
+
+    // Whatever changed about a service read from its manifest, the
+    // manifest changes along. Unless it fell behind, then we only come
+    // back to it once it caught up, see checkManifests().
+    string serviceName = getServiceName(path);
+    if (fellBack.count(serviceName) > 0 && (isManifestPath(path) || isChangelogPath(path))) {
+        return true;
+    }
+    bool fromManifest = manifestMode == MANIFESTS_READ &&
+                        (isManifestPath(path) || isChangelogPath(path) || manifests.count(serviceName) > 0);
+    if (!fromManifest && !isNodePath(path)) {
+        return refetchChildren(path, reads);
+    }
+
+    if (refetchPolicy.maxReads > 0 && *reads >= refetchPolicy.maxReads) {
+        return false;
+    }
+    (*reads)++;
+    if (!fromManifest) {
+        refreshNode(path);
+    } else if (!syncManifest(serviceName)) {
+        log(serviceName, "", "no manifest, reading instances");
+        addServiceInstances(getServicePath(serviceName));
+    }
+    return true;
+}
+
+// Forgets cached instances of a service which are no longer among its
+// children.
+void ZooKeeperStorageProcess::dropVanishedInstances(const string &serviceName, const vector<string> &childs) {
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find == snapshot.services.end()) {
+        return;
+    }
+    std::set<string> alive(childs.begin(), childs.end());
+    vector<Instance> &instances = find->second.instances;
+    for (vector<Instance>::iterator iter = instances.begin(); iter != instances.end();) {
+        if (alive.count(iter->node) == 0) {
+            log(serviceName, iter->node, "removed");
+            Instance removed = Instance();
+            removed.node = iter->node;
+            iter = instances.erase(iter);
+            record(Change::REMOVED, serviceName, removed);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+// Fetches the children of 'path' that are new to us, and drops those
+// gone, counting reads against the limit of the round. False if the
+// limit was hit first.
+bool ZooKeeperStorageProcess::refetchChildren(const string &path, int *reads) {
+    int maxReads = refetchPolicy.maxReads;
+    if (maxReads > 0 && *reads >= maxReads) {
+        return false;
+    }
+
     vector<string> childs;
     int code = zk->getChildren(path, true, &childs);
+    (*reads)++;
     if (code == ZOK) {
+        watchedChildren(path);
         auto serviceName = getServiceName(path);
-        std::map<string, Php::Value>::iterator find = services->find(serviceName);
+        // Instances without a data watch tell nobody when they go away.
+        dropVanishedInstances(serviceName, childs);
+        std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
         for (auto &child : childs) {
-            if (find==services->end() || !find->second.contains(child)) {
+            if (find == snapshot.services.end() || find->second.find(child) == NULL) {
+                if (maxReads > 0 && *reads >= maxReads) {
+                    return false;
+                }
                 addNewNode(serviceName, path + "/" + child);
+                (*reads)++;
+                find = snapshot.services.find(serviceName);
             }
         }
     }
+    return true;
+}
+
+// Re-reading the node re-arms its watch, and patches its instance in
+// place rather than refetching the service.
+void ZooKeeperStorageProcess::refreshNode(const string &path) {
+    string serviceName = getServiceName(path);
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find == snapshot.services.end() || find->second.find(getNodeName(path)) == NULL) {
+        // Removed meanwhile, or never known in the first place.
+        return;
+    }
+    addNewNode(serviceName, path);
 }
 
 void ZooKeeperStorageProcess::created(int64_t sessionId, const string &path) {
+    if (sessionId != zk->getSessionId()) {
+        return;
+    }
     log("new node " + path + " created");
+    dataWatches.erase(path);
+    countWatches();
+    if (isManifestPath(path) && manifestMode == MANIFESTS_READ) {
+        pending.insert(path);
+        scheduleRefetch();
+    }
 }
 
 void ZooKeeperStorageProcess::deleted(int64_t sessionId, const string &path) {
+    if (sessionId != zk->getSessionId()) {
+        return;
+    }
     log("node " + path + " deleted");
-    removeNode(path);
-}
\ No newline at end of file
+    // Fires the watches of either kind.
+    dataWatches.erase(path);
+    childWatches.erase(path);
+    countWatches();
+    if (isManifestPath(path) || isChangelogPath(path)) {
+        if (manifestMode == MANIFESTS_READ) {
+            // Falls back to the instances once refetched.
+            pending.insert(path);
+            scheduleRefetch();
+        }
+        return;
+    }
+    if (isNodePath(path)) {
+        removeNode(path);
+        publish();
+    }
+}
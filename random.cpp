@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "random.hpp"
+
+// Bumped in the child on fork(), generators seeded before reseed.
+static std::atomic<unsigned> forks(0);
+
+static void forked() {
+    forks++;
+}
+
+struct Generator {
+    uint64_t state[4];
+    // Value of 'forks' when seeded, 0 while not seeded at all.
+    unsigned seeded;
+};
+
+static thread_local Generator generator = {{0, 0, 0, 0}, 0};
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static bool entropy(void *buffer, size_t length) {
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, buffer, length, 0) == (long) length) {
+        return true;
+    }
+#endif
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool done = read(fd, buffer, length) == (ssize_t) length;
+    close(fd);
+    return done;
+}
+
+static void seed(Generator *g) {
+    static std::once_flag registered;
+    std::call_once(registered, []() {
+        pthread_atfork(NULL, NULL, forked);
+    });
+
+    uint64_t value;
+    if (!entropy(&value, sizeof(value))) {
+        // Still distinct per process and thread, good enough to pick.
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        value = now.tv_sec * 1000000000ULL + now.tv_nsec;
+        value ^= (uint64_t) getpid() << 32 ^ (uint64_t) (uintptr_t) g;
+    }
+    for (int i = 0; i < 4; i++) {
+        g->state[i] = splitmix(&value);
+    }
+    g->seeded = forks.load(std::memory_order_relaxed) + 1;
+}
+
+uint64_t randomNext() {
+    Generator *g = &generator;
+    if (g->seeded != forks.load(std::memory_order_relaxed) + 1) {
+        seed(g);
+    }
+
+    uint64_t *s = g->state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+uint64_t randomBelow(uint64_t bound) {
+    // Lemire's multiply-and-shift, rejecting the few low products that
+    // would otherwise favour some results over others.
+    unsigned __int128 product = (unsigned __int128) randomNext() * bound;
+    uint64_t low = (uint64_t) product;
+    if (low < bound) {
+        uint64_t threshold = -bound % bound;
+        while (low < threshold) {
+            product = (unsigned __int128) randomNext() * bound;
+            low = (uint64_t) product;
+        }
+    }
+    return (uint64_t) (product >> 64);
+}
@@ -0,0 +1,15 @@
+#ifndef __SERVICE_DISCOVERY_RANDOM_HPP__
+#define __SERVICE_DISCOVERY_RANDOM_HPP__
+
+#include <stdint.h>
+
+// Random numbers for picking instances. Each thread runs its own
+// xoshiro256** generator, seeded from the kernel on first use and
+// again after fork(), so there is no shared lock like rand() has and
+// children never repeat their parent's picks.
+uint64_t randomNext();
+
+// Uniformly distributed in [0, bound), bound must not be zero.
+uint64_t randomBelow(uint64_t bound);
+
+#endif // __SERVICE_DISCOVERY_RANDOM_HPP__
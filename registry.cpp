@@ -0,0 +1,295 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include <stout/error.hpp>
+#include <stout/json.hpp>
+#include <stout/none.hpp>
+
+#include "registry.hpp"
+
+using std::string;
+
+Service::Service() : version(0) { }
+
+Snapshot::Snapshot() : version(0) { }
+
+size_t Service::size() const {
+    return instances.size();
+}
+
+static bool byNode(const Instance &instance, const string &node) {
+    return instance.node < node;
+}
+
+const Instance *Service::find(const string &node) const {
+    std::vector<Instance>::const_iterator iter =
+            std::lower_bound(instances.begin(), instances.end(), node, byNode);
+    if (iter != instances.end() && iter->node == node) {
+        return &*iter;
+    }
+    return NULL;
+}
+
+void Service::set(const Instance &instance) {
+    std::vector<Instance>::iterator iter =
+            std::lower_bound(instances.begin(), instances.end(), instance.node, byNode);
+    if (iter != instances.end() && iter->node == instance.node) {
+        *iter = instance;
+    } else {
+        instances.insert(iter, instance);
+    }
+}
+
+bool Service::erase(const string &node) {
+    std::vector<Instance>::iterator iter =
+            std::lower_bound(instances.begin(), instances.end(), node, byNode);
+    if (iter != instances.end() && iter->node == node) {
+        instances.erase(iter);
+        return true;
+    }
+    return false;
+}
+
+Registry::Registry()
+        : snapshot(PackedSnapshot::pack(Snapshot())),
+          publishes(0),
+          journalSize(1024),
+          ready(false) { }
+
+std::shared_ptr<const PackedSnapshot> Registry::current() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return snapshot;
+}
+
+uint64_t Registry::generation() const {
+    return publishes.load(std::memory_order_acquire);
+}
+
+void Registry::publish(const Snapshot &_snapshot, const std::vector<Change> &changes) {
+    // Packed outside the lock, readers only wait for the swap.
+    publish(PackedSnapshot::pack(_snapshot), changes);
+}
+
+void Registry::publish(const std::shared_ptr<const PackedSnapshot> &published, const std::vector<Change> &changes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshot = published;
+    publishes.fetch_add(1, std::memory_order_release);
+    journal.insert(journal.end(), changes.begin(), changes.end());
+    while (journal.size() > journalSize) {
+        journal.pop_front();
+    }
+    notifications.notify();
+    for (Notifier *subscriber : subscribers) {
+        subscriber->notify();
+    }
+    versionChanged.notify_all();
+}
+
+void Registry::setJournalSize(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    journalSize = size;
+    while (journal.size() > journalSize) {
+        journal.pop_front();
+    }
+}
+
+bool Registry::changesSince(uint64_t since, uint64_t *version, std::vector<Change> *changes) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    *version = snapshot->version();
+    if (since >= snapshot->version()) {
+        return true;
+    }
+    if (journal.empty() || journal.front().version > since + 1) {
+        return false;
+    }
+    // Versions are consecutive, so the first change to return sits at
+    // a known distance from the front.
+    std::deque<Change>::const_iterator first = journal.begin() + (since + 1 - journal.front().version);
+    changes->insert(changes->end(), first, journal.end());
+    return true;
+}
+
+bool Registry::isReady() const {
+    return ready.load();
+}
+
+void Registry::markReady() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready = true;
+    }
+    readyChanged.notify_all();
+}
+
+bool Registry::waitReady(int64_t timeoutMs) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return readyChanged.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() {
+        return ready.load();
+    });
+}
+
+Option<uint64_t> Registry::waitChange(const string &service, uint64_t since, int64_t timeoutMs) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    Option<uint64_t> version = None();
+    versionChanged.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() {
+        if (service.empty()) {
+            version = snapshot->version();
+            return snapshot->version() > since;
+        }
+        PackedService find;
+        if (!snapshot->find(service, &find)) {
+            version = None();
+            // Removing the service is a change as well.
+            return since > 0;
+        }
+        version = find.version();
+        return find.version() > since;
+    });
+    return version;
+}
+
+Notifier &Registry::notifier() {
+    return notifications;
+}
+
+void Registry::subscribe(Notifier *notifier) {
+    std::lock_guard<std::mutex> lock(mutex);
+    subscribers.push_back(notifier);
+}
+
+void Registry::unsubscribe(Notifier *notifier) {
+    std::lock_guard<std::mutex> lock(mutex);
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), notifier), subscribers.end());
+}
+
+void Registry::prepareFork() {
+    mutex.lock();
+}
+
+void Registry::afterFork() {
+    mutex.unlock();
+}
+
+const char *changeType(Change::Type type) {
+    switch (type) {
+        case Change::ADDED:
+            return "added";
+        case Change::REMOVED:
+            return "removed";
+        case Change::UPDATED:
+            return "updated";
+    }
+    return "unknown";
+}
+
+Option<Change::Type> parseChangeType(const string &name) {
+    if (name == "added") {
+        return Change::ADDED;
+    }
+    if (name == "removed") {
+        return Change::REMOVED;
+    }
+    if (name == "updated") {
+        return Change::UPDATED;
+    }
+    return None();
+}
+
+bool sameInstance(const Instance &left, const Instance &right) {
+    return left.host == right.host && left.port == right.port && left.name == right.name &&
+           left.weight == right.weight && left.mzxid == right.mzxid && left.ctime == right.ctime &&
+           left.source == right.source;
+}
+
+picojson::value instanceToJson(const Instance &instance) {
+    picojson::object value;
+    value["host"] = picojson::value(instance.host);
+    value["port"] = picojson::value((double) instance.port);
+    value["name"] = picojson::value(instance.name);
+    if (instance.weight >= 0) {
+        value["weight"] = picojson::value((double) instance.weight);
+    }
+    // zxids do not fit into a double, keep them as strings.
+    value["mzxid"] = picojson::value(std::to_string(instance.mzxid));
+    value["ctime"] = picojson::value(std::to_string(instance.ctime));
+    if (!instance.source.empty()) {
+        value["source"] = picojson::value(instance.source);
+    }
+    return picojson::value(value);
+}
+
+Try<Instance> instanceFromJson(const string &node, const picojson::value &value) {
+    if (!value.is<picojson::object>() ||
+        !value.get("host").is<string>() || !value.get("port").is<double>() ||
+        !value.get("mzxid").is<string>()) {
+        return Error("invalid instance " + node);
+    }
+    Instance instance;
+    instance.node = node;
+    instance.host = value.get("host").get<string>();
+    instance.port = (int) value.get("port").get<double>();
+    instance.name = value.get("name").to_str();
+    instance.weight = value.get("weight").is<double>() ? (int) value.get("weight").get<double>() : -1;
+    instance.mzxid = strtoll(value.get("mzxid").get<string>().c_str(), NULL, 10);
+    // Missing from what older versions saved.
+    instance.ctime = value.get("ctime").is<string>() ? strtoll(value.get("ctime").get<string>().c_str(), NULL, 10) : 0;
+    instance.source = value.get("source").is<string>() ? value.get("source").get<string>() : "";
+    return instance;
+}
+
+picojson::value snapshotToJson(const Snapshot &snapshot) {
+    picojson::object services;
+    for (auto &service : snapshot.services) {
+        picojson::object instances;
+        for (auto &instance : service.second.instances) {
+            instances[instance.node] = instanceToJson(instance);
+        }
+        services[service.first] = picojson::value(instances);
+    }
+
+    picojson::object root;
+    root["services"] = picojson::value(services);
+    return picojson::value(root);
+}
+
+Try<Snapshot> snapshotFromJson(const picojson::value &root) {
+    if (!root.is<picojson::object>() || !root.get("services").is<picojson::object>()) {
+        return Error("services not found in snapshot");
+    }
+
+    Snapshot snapshot;
+    for (auto &service : root.get("services").get<picojson::object>()) {
+        if (!service.second.is<picojson::object>()) {
+            return Error("invalid service " + service.first + " in snapshot");
+        }
+        // Versions restart with the process, what is loaded is its first.
+        Service &instances = snapshot.services[service.first];
+        instances.version = 1;
+        for (auto &node : service.second.get<picojson::object>()) {
+            Try<Instance> instance = instanceFromJson(node.first, node.second);
+            if (instance.isError()) {
+                return Error(instance.error() + " in snapshot");
+            }
+            instances.set(instance.get());
+        }
+    }
+    snapshot.version = 1;
+    return snapshot;
+}
+
+string serialize(const Snapshot &snapshot) {
+    return snapshotToJson(snapshot).serialize();
+}
+
+Try<Snapshot> deserialize(const string &data) {
+    picojson::value root;
+    std::istringstream is(data);
+    string err = picojson::parse(root, is);
+    if (!err.empty()) {
+        return Error(err);
+    }
+    return snapshotFromJson(root);
+}
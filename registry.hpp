@@ -0,0 +1,192 @@
+#ifndef __SERVICE_DISCOVERY_REGISTRY_HPP__
+#define __SERVICE_DISCOVERY_REGISTRY_HPP__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stout/json.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+#include "notifier.hpp"
+#include "packed.hpp"
+
+// An instance of a service as registered by nerve.
+struct Instance {
+    // Name of the instance znode.
+    std::string node;
+    std::string host;
+    int port;
+    std::string name;
+    // Negative when the instance config carries no weight.
+    int weight;
+    // Last modified zxid of the instance znode, lets a restarted
+    // process tell whether its cached copy is still current.
+    int64_t mzxid;
+    // Creation time of the instance znode, in milliseconds since the
+    // epoch, 0 when unknown. Drives slow start, see slowstart.hpp.
+    int64_t ctime;
+    // Name of the ensemble the instance was read from, empty unless
+    // merged from several, see federation.hpp.
+    std::string source;
+};
+
+// The instances of a service.
+struct Service {
+    Service();
+
+    // Version of the registry this service last changed in.
+    uint64_t version;
+
+    // Sorted by znode name.
+    std::vector<Instance> instances;
+
+    size_t size() const;
+
+    const Instance *find(const std::string &node) const;
+
+    // Adds or replaces the instance with the same znode name.
+    void set(const Instance &instance);
+
+    bool erase(const std::string &node);
+};
+
+struct Snapshot {
+    Snapshot();
+
+    // Bumped with every change to the registry, never goes backwards
+    // within a process. Versions are local to the process, they are
+    // not comparable across processes.
+    uint64_t version;
+
+    // All known services, keyed by service name.
+    std::map<std::string, Service> services;
+};
+
+// A change to the registry, as kept in the journal.
+struct Change {
+    enum Type {
+        ADDED,
+        REMOVED,
+        UPDATED,
+    } type;
+
+    // Version of the registry the change led to.
+    uint64_t version;
+
+    std::string service;
+
+    // The instance as of the change, only its node is set on removal.
+    // An empty node on removal means the whole service went away.
+    Instance instance;
+};
+
+// Holds the latest snapshot published by the storage process. Readers
+// get an immutable, packed snapshot that stays valid for as long as
+// they hold on to it, regardless of what is published meanwhile.
+class Registry {
+public:
+    Registry();
+
+    std::shared_ptr<const PackedSnapshot> current() const;
+
+    // Bumped on every publish. A single atomic load, so that readers
+    // can tell whether what they hold is still current without taking
+    // the lock or touching the reference count of the snapshot.
+    uint64_t generation() const;
+
+    // Publishes a packed copy of 'snapshot', along with the changes
+    // that led there from the last one.
+    void publish(const Snapshot &snapshot, const std::vector<Change> &changes = std::vector<Change>());
+
+    // Publishes a snapshot packed elsewhere, e.g. mapped from a file.
+    void publish(const std::shared_ptr<const PackedSnapshot> &snapshot,
+                 const std::vector<Change> &changes = std::vector<Change>());
+
+    // How many changes the journal keeps before dropping the oldest.
+    void setJournalSize(size_t size);
+
+    // Fills in the changes made after 'since' and the version they
+    // lead to. Returns false when the journal no longer reaches back
+    // that far, in which case callers have to resync from a snapshot.
+    bool changesSince(uint64_t since, uint64_t *version, std::vector<Change> *changes) const;
+
+    // Blocks for up to 'timeoutMs' until the version of a service, or
+    // of the registry with an empty name, moves past 'since'. Returns
+    // the version by then, none if the service is or went missing.
+    Option<uint64_t> waitChange(const std::string &service, uint64_t since, int64_t timeoutMs) const;
+
+    // Signalled on every publish.
+    Notifier &notifier();
+
+    // Additional notifiers signalled on every publish, for consumers
+    // that must not take notifications away from userland.
+    void subscribe(Notifier *notifier);
+
+    void unsubscribe(Notifier *notifier);
+
+    // Whether a complete snapshot has been loaded, either from the
+    // state directory or from a finished walk of the ensemble.
+    bool isReady() const;
+
+    void markReady();
+
+    // Waits up to 'timeoutMs' for the registry to become ready.
+    bool waitReady(int64_t timeoutMs) const;
+
+    // Fork handlers, keep a child forked in the middle of a publish
+    // from inheriting a locked registry.
+    void prepareFork();
+
+    void afterFork();
+
+private:
+    mutable std::mutex mutex;
+    std::shared_ptr<const PackedSnapshot> snapshot;
+    std::atomic<uint64_t> publishes;
+
+    // Most recent changes, oldest first. Versions in there are
+    // consecutive as every change bumps the version by one.
+    std::deque<Change> journal;
+    size_t journalSize;
+
+    std::atomic<bool> ready;
+    mutable std::condition_variable readyChanged;
+
+    mutable std::condition_variable versionChanged;
+
+    Notifier notifications;
+    std::vector<Notifier *> subscribers;
+};
+
+// Whether two copies of an instance carry the same config.
+bool sameInstance(const Instance &left, const Instance &right);
+
+// Name of a change type, as exposed to userland and sent by relays.
+const char *changeType(Change::Type type);
+
+Option<Change::Type> parseChangeType(const std::string &name);
+
+// JSON forms of instances and snapshots, as saved to the state
+// directory and sent by relays.
+picojson::value instanceToJson(const Instance &instance);
+
+Try<Instance> instanceFromJson(const std::string &node, const picojson::value &value);
+
+picojson::value snapshotToJson(const Snapshot &snapshot);
+
+Try<Snapshot> snapshotFromJson(const picojson::value &value);
+
+std::string serialize(const Snapshot &snapshot);
+
+Try<Snapshot> deserialize(const std::string &data);
+
+#endif // __SERVICE_DISCOVERY_REGISTRY_HPP__
@@ -0,0 +1,806 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include <stout/error.hpp>
+#include <stout/none.hpp>
+#include <stout/result.hpp>
+
+#include "log.hpp"
+#include "packed.hpp"
+#include "random.hpp"
+#include "relay.hpp"
+
+using std::string;
+
+// Frames larger than this are taken for garbage.
+const uint32_t MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+// Hosts whose unsent output grows past this are dropped, they resync
+// from a snapshot once they reconnect.
+const size_t MAX_PENDING_OUTPUT = 64 * 1024 * 1024;
+
+// How long a host waits before trying the next relay.
+const std::chrono::seconds RELAY_RETRY_INTERVAL(1);
+
+// How often relays ping the hosts they serve.
+const int64_t RELAY_PING_INTERVAL_MS = 5000;
+
+// How long a host waits for a frame before it gives up on the relay,
+// a few pings missed.
+const int64_t RELAY_TIMEOUT_MS = 3 * RELAY_PING_INTERVAL_MS;
+
+const string UNIX_PREFIX = "unix:";
+
+// Group relays elect the one serving hosts in.
+const string RELAY_GROUP_PATH = "/nerve/relays";
+
+const Duration RELAY_ELECTION_TIMEOUT = Seconds(60);
+
+// A socket for 'address', along with what to bind or connect it to.
+struct Endpoint {
+    int family;
+    socklen_t length;
+    struct sockaddr_storage address;
+};
+
+static Try<Endpoint> resolve(const string &address) {
+    Endpoint endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+
+    if (address.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0) {
+        string path = address.substr(UNIX_PREFIX.size());
+        struct sockaddr_un *un = (struct sockaddr_un *) &endpoint.address;
+        if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+            return Error("invalid unix socket path " + path);
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        endpoint.family = AF_UNIX;
+        endpoint.length = sizeof(struct sockaddr_un);
+        return endpoint;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) {
+        return Error("no port in " + address);
+    }
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *result;
+    int error = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result);
+    if (error != 0) {
+        return Error("failed to resolve " + address + ": " + gai_strerror(error));
+    }
+    endpoint.family = result->ai_family;
+    endpoint.length = result->ai_addrlen;
+    memcpy(&endpoint.address, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    return endpoint;
+}
+
+static Try<int> listenOn(const string &address) {
+    Try<Endpoint> endpoint = resolve(address);
+    if (endpoint.isError()) {
+        return Error(endpoint.error());
+    }
+    int fd = socket(endpoint.get().family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return ErrnoError("failed to create socket");
+    }
+    if (endpoint.get().family == AF_UNIX) {
+        // Left behind by a relay that did not get to clean up, unless a
+        // live relay still answers on it.
+        const char *path = ((const struct sockaddr_un *) &endpoint.get().address)->sun_path;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            ErrnoError error("failed to create socket");
+            close(fd);
+            return error;
+        }
+        int connected = connect(probe, (const struct sockaddr *) &endpoint.get().address, endpoint.get().length);
+        int probeErrno = errno;
+        close(probe);
+        if (connected == 0) {
+            close(fd);
+            return Error(address + " is served by another relay");
+        }
+        if (probeErrno == ECONNREFUSED) {
+            unlink(path);
+        }
+    } else {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (bind(fd, (const struct sockaddr *) &endpoint.get().address, endpoint.get().length) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        ErrnoError error("failed to listen on " + address);
+        close(fd);
+        return error;
+    }
+    return fd;
+}
+
+static Try<int> connectTo(const string &address) {
+    Try<Endpoint> endpoint = resolve(address);
+    if (endpoint.isError()) {
+        return Error(endpoint.error());
+    }
+    int fd = socket(endpoint.get().family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return ErrnoError("failed to create socket");
+    }
+    if (connect(fd, (const struct sockaddr *) &endpoint.get().address, endpoint.get().length) != 0) {
+        ErrnoError error("failed to connect to " + address);
+        close(fd);
+        return error;
+    }
+    if (endpoint.get().family != AF_UNIX) {
+        // Pings tell a hung relay from a quiet one, keepalives also get
+        // rid of connections to hosts that went away.
+        int keepalive = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    }
+    return fd;
+}
+
+static string frame(const picojson::value &message) {
+    string payload = message.serialize();
+    uint32_t length = htonl(payload.size());
+    return string((const char *) &length, sizeof(length)) + payload;
+}
+
+// Takes the next complete frame off the front of 'input', none until
+// all of it has arrived.
+static Result<picojson::value> unframe(string *input) {
+    if (input->size() < sizeof(uint32_t)) {
+        return None();
+    }
+    uint32_t length;
+    memcpy(&length, input->data(), sizeof(length));
+    length = ntohl(length);
+    if (length > MAX_FRAME_SIZE) {
+        return Error("frame of " + std::to_string(length) + " bytes");
+    }
+    if (input->size() < sizeof(length) + length) {
+        return None();
+    }
+
+    picojson::value message;
+    std::istringstream is(input->substr(sizeof(length), length));
+    input->erase(0, sizeof(length) + length);
+    string err = picojson::parse(message, is);
+    if (!err.empty()) {
+        return Error(err);
+    }
+    if (!message.is<picojson::object>()) {
+        return Error("frame is not an object");
+    }
+    return message;
+}
+
+static Try<Nothing> writeFully(int fd, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t length = ::send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0) {
+            return ErrnoError("failed to send");
+        }
+        written += length;
+    }
+    return Nothing();
+}
+
+RelayServer::Host::Host() : fd(-1), greeted(false), version(0), closing(false) { }
+
+RelayServer::RelayServer(const string &_address,
+                         Registry *_registry,
+                         const string &_servers,
+                         const string &_advertised)
+        : address(_address),
+          registry(_registry),
+          servers(_servers),
+          advertised(_advertised),
+          epoch(std::to_string(randomNext())),
+          election(NULL),
+          listenFd(-1) { }
+
+RelayServer::~RelayServer() {
+    stop();
+}
+
+Try<Nothing> RelayServer::start() {
+    Try<int> fd = listenOn(address);
+    if (fd.isError()) {
+        return Error(fd.error());
+    }
+    Try<int> publishedFd = published.fd();
+    Try<int> stoppingFd = stopping.fd();
+    Try<int> redirectingFd = redirecting.fd();
+    if (publishedFd.isError() || stoppingFd.isError() || redirectingFd.isError()) {
+        close(fd.get());
+        return Error("failed to create notifiers");
+    }
+    listenFd = fd.get();
+    registry->subscribe(&published);
+    thread = std::thread(&RelayServer::run, this);
+    log("relaying on " + address + " in epoch " + epoch);
+    if (!advertised.empty()) {
+        election = new LeaderElection(servers, RELAY_ELECTION_TIMEOUT, RELAY_GROUP_PATH, [](bool) { },
+                                      advertised, [this](const Option<string> &leader) {
+                    elected(leader);
+                });
+    }
+    return Nothing();
+}
+
+void RelayServer::stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+    // Let another relay take over right away.
+    delete election;
+    election = NULL;
+    stopping.notify();
+    thread.join();
+    registry->unsubscribe(&published);
+    close(listenFd);
+    listenFd = -1;
+}
+
+static int64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RelayServer::run() {
+    std::map<int, Host> hosts;
+    std::vector<struct pollfd> fds;
+    int64_t nextPing = steadyMs() + RELAY_PING_INTERVAL_MS;
+    while (true) {
+        fds.clear();
+        fds.push_back({stopping.fd().get(), POLLIN, 0});
+        fds.push_back({published.fd().get(), POLLIN, 0});
+        fds.push_back({redirecting.fd().get(), POLLIN, 0});
+        fds.push_back({listenFd, POLLIN, 0});
+        for (auto &host : hosts) {
+            short events = POLLIN;
+            if (!host.second.output.empty()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({host.first, events, 0});
+        }
+
+        if (poll(fds.data(), fds.size(), std::max(nextPing - steadyMs(), (int64_t) 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("relay stopped: " + string(strerror(errno)));
+            break;
+        }
+        if (fds[0].revents != 0) {
+            break;
+        }
+        if (steadyMs() >= nextPing) {
+            nextPing = steadyMs() + RELAY_PING_INTERVAL_MS;
+            for (auto &host : hosts) {
+                if (host.second.greeted) {
+                    ping(&host.second);
+                }
+            }
+        }
+        if (fds[1].revents != 0) {
+            published.acknowledge();
+            for (auto &host : hosts) {
+                if (host.second.greeted) {
+                    push(&host.second);
+                }
+            }
+        }
+        if (fds[2].revents != 0) {
+            redirecting.acknowledge();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (leader.isSome()) {
+                log("redirecting hosts to " + leader.get());
+                for (auto &host : hosts) {
+                    if (host.second.greeted) {
+                        redirect(&host.second, leader.get());
+                    }
+                }
+            }
+        }
+        if (fds[3].revents != 0) {
+            int fd;
+            while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                hosts[fd].fd = fd;
+            }
+        }
+
+        for (size_t i = 4; i < fds.size(); i++) {
+            std::map<int, Host>::iterator host = hosts.find(fds[i].fd);
+            bool alive = true;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                alive = receive(&host->second);
+            }
+            if (alive) {
+                alive = flush(&host->second);
+            }
+            if (!alive || (host->second.closing && host->second.output.empty())) {
+                close(host->first);
+                hosts.erase(host);
+            }
+        }
+    }
+
+    for (auto &host : hosts) {
+        close(host.first);
+    }
+}
+
+bool RelayServer::receive(Host *host) {
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t length = recv(host->fd, buffer, sizeof(buffer), 0);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (length <= 0) {
+            return false;
+        }
+        host->input.append(buffer, length);
+    }
+
+    while (true) {
+        Result<picojson::value> message = unframe(&host->input);
+        if (message.isError()) {
+            log("dropping host: " + message.error());
+            return false;
+        }
+        if (message.isNone()) {
+            return true;
+        }
+        if (message.get().get("type").to_str() != "hello") {
+            log("dropping host: unexpected " + message.get().get("type").to_str());
+            return false;
+        }
+        if (host->closing) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (leader.isSome()) {
+                redirect(host, leader.get());
+                continue;
+            }
+        }
+        host->greeted = true;
+        if (message.get().get("epoch").to_str() != epoch) {
+            sendSnapshot(host);
+        } else {
+            host->version = strtoull(message.get().get("version").to_str().c_str(), NULL, 10);
+            push(host);
+        }
+    }
+}
+
+bool RelayServer::flush(Host *host) {
+    while (!host->output.empty()) {
+        ssize_t length = ::send(host->fd, host->output.data(), host->output.size(), MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (length < 0) {
+            return false;
+        }
+        host->output.erase(0, length);
+    }
+    return host->output.size() <= MAX_PENDING_OUTPUT;
+}
+
+void RelayServer::push(Host *host) {
+    uint64_t version;
+    std::vector<Change> changes;
+    if (!registry->changesSince(host->version, &version, &changes)) {
+        sendSnapshot(host);
+        return;
+    }
+    if (changes.empty() && version == host->version) {
+        return;
+    }
+
+    picojson::array list;
+    for (auto &change : changes) {
+        picojson::object value;
+        value["type"] = picojson::value(changeType(change.type));
+        value["service"] = picojson::value(change.service);
+        value["node"] = picojson::value(change.instance.node);
+        if (change.type != Change::REMOVED) {
+            value["instance"] = instanceToJson(change.instance);
+        }
+        list.push_back(picojson::value(value));
+    }
+    picojson::object message;
+    message["type"] = picojson::value("changes");
+    message["epoch"] = picojson::value(epoch);
+    message["version"] = picojson::value(std::to_string(version));
+    message["changes"] = picojson::value(list);
+    send(host, picojson::value(message));
+    host->version = version;
+}
+
+void RelayServer::sendSnapshot(Host *host) {
+    std::shared_ptr<const PackedSnapshot> snapshot = registry->current();
+    picojson::object message;
+    message["type"] = picojson::value("snapshot");
+    message["epoch"] = picojson::value(epoch);
+    message["version"] = picojson::value(std::to_string(snapshot->version()));
+    message["registry"] = snapshotToJson(snapshot->unpack());
+    send(host, picojson::value(message));
+    host->version = snapshot->version();
+}
+
+void RelayServer::ping(Host *host) {
+    picojson::object message;
+    message["type"] = picojson::value("ping");
+    message["epoch"] = picojson::value(epoch);
+    message["version"] = picojson::value(std::to_string(host->version));
+    send(host, picojson::value(message));
+}
+
+void RelayServer::redirect(Host *host, const string &relay) {
+    picojson::object message;
+    message["type"] = picojson::value("redirect");
+    message["relay"] = picojson::value(relay);
+    send(host, picojson::value(message));
+    host->greeted = false;
+    host->closing = true;
+}
+
+void RelayServer::elected(const Option<string> &relay) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (relay.isSome() && !relay.get().empty() && relay.get() != advertised) {
+            leader = relay.get();
+        } else {
+            leader = None();
+        }
+    }
+    redirecting.notify();
+}
+
+void RelayServer::send(Host *host, const picojson::value &message) {
+    host->output += frame(message);
+}
+
+RelayClient::RelayClient(const std::vector<string> &_relays,
+                         Registry *_registry,
+                         StateStore *_stateStore,
+                         const SlowStart &_slowStart)
+        : relays(_relays),
+          registry(_registry),
+          stateStore(_stateStore),
+          slowStart(_slowStart),
+          packer(_slowStart),
+          version(0),
+          ramping(false),
+          stopping(false),
+          fd(-1) { }
+
+RelayClient::~RelayClient() {
+    stop();
+}
+
+void RelayClient::start() {
+    // Start from whatever was published before us, e.g. the snapshot
+    // saved by our predecessor.
+    snapshot = registry->current()->unpack();
+    thread = std::thread(&RelayClient::run, this);
+}
+
+void RelayClient::stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        if (fd >= 0) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    stopped.notify_all();
+    thread.join();
+}
+
+int64_t RelayClient::stalenessMs(int64_t nowMs) const {
+    return staleness.ms(nowMs);
+}
+
+void RelayClient::run() {
+    size_t next = 0;
+    Option<string> target = None();
+    while (!stopping) {
+        bool wasRedirected = target.isSome();
+        string relay = wasRedirected ? target.get() : relays[next++ % relays.size()];
+        target = None();
+        redirected = None();
+        Try<Nothing> followed = follow(relay);
+        staleness.lapse();
+        if (stopping) {
+            break;
+        }
+        // Only the relays we were configured with get to redirect us,
+        // lest two relays disagreeing on the leader bounce us around.
+        if (redirected.isSome() && !wasRedirected) {
+            log("redirected from relay " + relay + " to " + redirected.get());
+            target = redirected;
+            continue;
+        }
+        log("lost relay " + relay + ": " + (followed.isError() ? followed.error() : "closed"));
+
+        std::unique_lock<std::mutex> lock(mutex);
+        stopped.wait_for(lock, RELAY_RETRY_INTERVAL, [this]() {
+            return stopping.load();
+        });
+    }
+}
+
+Try<Nothing> RelayClient::follow(const string &relay) {
+    Try<int> connected = connectTo(relay);
+    if (connected.isError()) {
+        return Error(connected.error());
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            close(connected.get());
+            return Nothing();
+        }
+        fd = connected.get();
+    }
+    // Wake up now and then to check on the relay, and to move ramped
+    // weights on, see publish().
+    int64_t wakeMs = RELAY_PING_INTERVAL_MS;
+    if (slowStart.windowMs > 0) {
+        wakeMs = std::min(wakeMs, slowStart.intervalMs);
+    }
+    struct timeval interval;
+    interval.tv_sec = wakeMs / 1000;
+    interval.tv_usec = (wakeMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &interval, sizeof(interval));
+
+    picojson::object hello;
+    hello["type"] = picojson::value("hello");
+    hello["epoch"] = picojson::value(epoch);
+    hello["version"] = picojson::value(epoch.empty() ? string() : std::to_string(version));
+    Try<Nothing> result = writeFully(fd, frame(picojson::value(hello)));
+
+    string input;
+    char buffer[64 * 1024];
+    int64_t heard = steadyMs();
+    while (result.isSome()) {
+        Result<picojson::value> message = unframe(&input);
+        if (message.isError()) {
+            result = Error(message.error());
+            break;
+        }
+        if (message.isSome()) {
+            result = apply(message.get());
+            continue;
+        }
+
+        ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (steadyMs() - heard >= RELAY_TIMEOUT_MS) {
+                result = Error("no word from relay in " + std::to_string(RELAY_TIMEOUT_MS) + "ms");
+                break;
+            }
+            publish();
+            continue;
+        }
+        if (length < 0) {
+            result = ErrnoError("failed to receive");
+        } else if (length == 0) {
+            result = Error("closed by relay");
+        } else {
+            heard = steadyMs();
+            input.append(buffer, length);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    close(fd);
+    fd = -1;
+    return result;
+}
+
+Try<Nothing> RelayClient::apply(const picojson::value &message) {
+    string type = message.get("type").to_str();
+    string messageEpoch = message.get("epoch").to_str();
+    uint64_t messageVersion = strtoull(message.get("version").to_str().c_str(), NULL, 10);
+
+    if (type == "redirect") {
+        redirected = message.get("relay").to_str();
+        return Error("redirected to " + redirected.get());
+    }
+
+    if (type == "ping") {
+        if (messageEpoch != epoch) {
+            return Error("ping from epoch " + messageEpoch + " while following " + epoch);
+        }
+        // Sent after everything before it, so nothing is missing.
+        staleness.confirm();
+        return Nothing();
+    }
+
+    if (type == "snapshot") {
+        Try<Snapshot> replacement = snapshotFromJson(message.get("registry"));
+        if (replacement.isError()) {
+            return Error(replacement.error());
+        }
+        replace(replacement.get());
+    } else if (type == "changes") {
+        if (messageEpoch != epoch) {
+            return Error("changes from epoch " + messageEpoch + " while following " + epoch);
+        }
+        if (!message.get("changes").is<picojson::array>()) {
+            return Error("changes missing");
+        }
+        for (auto &change : message.get("changes").get<picojson::array>()) {
+            Try<Nothing> applied = applyChange(change);
+            if (applied.isError()) {
+                return applied;
+            }
+        }
+    } else {
+        return Error("unexpected " + type);
+    }
+
+    epoch = messageEpoch;
+    version = messageVersion;
+    publish();
+    // Only once a relay sent us what it has, not when one merely took
+    // the connection. Without changes the registry holds it already.
+    registry->markReady();
+    // Relays send what we miss right away, and every change after.
+    staleness.confirm();
+    return Nothing();
+}
+
+void RelayClient::replace(const Snapshot &replacement) {
+    for (std::map<string, Service>::iterator iter = snapshot.services.begin(); iter != snapshot.services.end();) {
+        if (replacement.services.count(iter->first) == 0) {
+            string serviceName = iter->first;
+            iter = snapshot.services.erase(iter);
+            record(Change::REMOVED, serviceName, Instance());
+        } else {
+            ++iter;
+        }
+    }
+
+    for (auto &service : replacement.services) {
+        Service &current = snapshot.services[service.first];
+        std::vector<string> vanished;
+        for (auto &instance : current.instances) {
+            if (service.second.find(instance.node) == NULL) {
+                vanished.push_back(instance.node);
+            }
+        }
+        for (auto &node : vanished) {
+            current.erase(node);
+            Instance removed = Instance();
+            removed.node = node;
+            record(Change::REMOVED, service.first, removed);
+        }
+
+        for (auto &instance : service.second.instances) {
+            const Instance *known = current.find(instance.node);
+            if (known == NULL || !sameInstance(*known, instance)) {
+                Change::Type type = known == NULL ? Change::ADDED : Change::UPDATED;
+                current.set(instance);
+                record(type, service.first, instance);
+            }
+        }
+    }
+}
+
+Try<Nothing> RelayClient::applyChange(const picojson::value &change) {
+    Option<Change::Type> type = parseChangeType(change.get("type").to_str());
+    string serviceName = change.get("service").to_str();
+    string node = change.get("node").to_str();
+    if (type.isNone() || serviceName.empty()) {
+        return Error("invalid change");
+    }
+
+    if (type.get() == Change::REMOVED) {
+        if (node.empty()) {
+            if (snapshot.services.erase(serviceName) > 0) {
+                record(Change::REMOVED, serviceName, Instance());
+            }
+            return Nothing();
+        }
+        std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+        if (find != snapshot.services.end() && find->second.erase(node)) {
+            Instance removed = Instance();
+            removed.node = node;
+            record(Change::REMOVED, serviceName, removed);
+        }
+        return Nothing();
+    }
+
+    Try<Instance> instance = instanceFromJson(node, change.get("instance"));
+    if (instance.isError()) {
+        return Error(instance.error());
+    }
+    Service &service = snapshot.services[serviceName];
+    Change::Type applied = service.find(node) == NULL ? Change::ADDED : Change::UPDATED;
+    service.set(instance.get());
+    record(applied, serviceName, instance.get());
+    return Nothing();
+}
+
+void RelayClient::record(Change::Type type, const string &serviceName, const Instance &instance) {
+    snapshot.version++;
+    std::map<string, Service>::iterator find = snapshot.services.find(serviceName);
+    if (find != snapshot.services.end()) {
+        find->second.version = snapshot.version;
+    }
+    Change change;
+    change.type = type;
+    change.version = snapshot.version;
+    change.service = serviceName;
+    change.instance = instance;
+    changes.push_back(change);
+}
+
+void RelayClient::publish() {
+    if (changes.empty() && !ramping) {
+        return;
+    }
+    int64_t now = wallClockMs();
+    std::shared_ptr<const PackedSnapshot> packed = packer.pack(snapshot, changes, now);
+    ramping = slowStart.isRamping(snapshot, now);
+    registry->publish(packed, changes);
+    changes.clear();
+
+    if (stateStore != NULL) {
+        Try<Nothing> saved = stateStore->saveRegistry(*packed);
+        if (saved.isError()) {
+            log("failed to save registry: " + saved.error());
+        }
+    }
+}
@@ -0,0 +1,204 @@
+#ifndef __SERVICE_DISCOVERY_RELAY_HPP__
+#define __SERVICE_DISCOVERY_RELAY_HPP__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stout/json.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+#include "election.hpp"
+#include "notifier.hpp"
+#include "registry.hpp"
+#include "slowstart.hpp"
+#include "staleness.hpp"
+#include "state.hpp"
+
+// Relays let hosts follow the registry without a ZooKeeper session of
+// their own. A relay syncs with the ensemble like any other process
+// and streams what it publishes to the hosts connected to it, which
+// publish it in turn. The ensemble then only serves the watches of the
+// relays, however many hosts there are.
+//
+// Relays and hosts talk over TCP ("<host>:<port>") or Unix sockets
+// ("unix:<path>"), in frames of a 4 byte big endian length followed by
+// a JSON object:
+//
+//     host   {"type": "hello", "epoch": <epoch>, "version": <version>}
+//     relay  {"type": "snapshot", "epoch": ..., "version": ..., "registry": <snapshot>}
+//     relay  {"type": "changes", "epoch": ..., "version": ..., "changes": [<change>, ...]}
+//     relay  {"type": "ping", "epoch": ..., "version": ...}
+//     relay  {"type": "redirect", "relay": <address>}
+//
+// Changes are {"type": "added"|"updated"|"removed", "service": <name>,
+// "node": <node>, "instance": <instance>}, without the instance on
+// removal and with an empty node when the whole service went away.
+// Snapshots and instances are laid out as in snapshot.json, epochs and
+// versions are decimal strings.
+//
+// Versions are those of the relay and only mean something along with
+// its epoch, drawn at random when the relay starts. A host says hello
+// with the epoch and version it got last, empty on first contact, and
+// gets the changes made since if the relay still has them, a snapshot
+// otherwise. The relay then sends changes as they are published, and
+// pings every few seconds. Hosts that hear nothing for a few pings
+// move on to the next relay.
+//
+// Relays given an address to advertise elect the one that serves hosts
+// among them, through a LeaderElection on RELAY_GROUP_PATH. The others
+// keep in sync to take over, and redirect hosts to the elected relay,
+// so hosts only need to know of a few relays to find it. Relays serve
+// hosts themselves while no relay is elected.
+class RelayServer {
+public:
+    // 'servers' is the ensemble to hold the election on, there is none
+    // unless 'advertised' is given.
+    RelayServer(const std::string &address,
+                Registry *registry,
+                const std::string &servers = "",
+                const std::string &advertised = "");
+
+    ~RelayServer();
+
+    // Starts listening and serving hosts from a thread of its own.
+    Try<Nothing> start();
+
+    void stop();
+
+private:
+    struct Host {
+        Host();
+
+        int fd;
+        std::string input;
+        std::string output;
+        // Whether the host said hello, only then it gets changes.
+        bool greeted;
+        uint64_t version;
+        // Dropped once the output is flushed, e.g. after a redirect.
+        bool closing;
+    };
+
+    void run();
+
+    // Called by the election whenever another relay is elected.
+    void elected(const Option<std::string> &leader);
+
+    bool receive(Host *host);
+
+    bool flush(Host *host);
+
+    void push(Host *host);
+
+    void sendSnapshot(Host *host);
+
+    void ping(Host *host);
+
+    void redirect(Host *host, const std::string &relay);
+
+    void send(Host *host, const picojson::value &message);
+
+    const std::string address;
+    Registry *registry;
+    const std::string servers;
+    const std::string advertised;
+    const std::string epoch;
+
+    LeaderElection *election;
+
+    // Where hosts are sent instead, none while they are ours to serve.
+    std::mutex mutex;
+    Option<std::string> leader;
+    Notifier redirecting;
+
+    int listenFd;
+    Notifier published;
+    Notifier stopping;
+    std::thread thread;
+};
+
+// Follows the registry of the first relay that answers, moving on to
+// the next one whenever the connection is lost. A redirect is followed
+// right away, once, for relays to point at the elected one. Weights are
+// ramped here as they are by the storage process, relays only send what
+// changed.
+class RelayClient {
+public:
+    RelayClient(const std::vector<std::string> &relays,
+                Registry *registry,
+                StateStore *stateStore,
+                const SlowStart &slowStart = SlowStart());
+
+    ~RelayClient();
+
+    // Starts following from a thread of its own, picking up from what
+    // the registry holds by now.
+    void start();
+
+    void stop();
+
+    // How long the working copy has been out of sync with the relay by
+    // 'nowMs', 0 while it is not. Safe to call from any thread.
+    int64_t stalenessMs(int64_t nowMs) const;
+
+private:
+    void run();
+
+    // Follows one relay until the connection fails.
+    Try<Nothing> follow(const std::string &relay);
+
+    Try<Nothing> apply(const picojson::value &message);
+
+    // Replaces the working copy with what the relay sent, recording the
+    // differences as changes.
+    void replace(const Snapshot &replacement);
+
+    Try<Nothing> applyChange(const picojson::value &change);
+
+    void record(Change::Type type, const std::string &serviceName, const Instance &instance);
+
+    void publish();
+
+    const std::vector<std::string> relays;
+    Registry *registry;
+    StateStore *stateStore;
+    const SlowStart slowStart;
+    Packer packer;
+
+    // Working copy of the registry, versioned locally like the one of
+    // the storage process as relays have versions of their own.
+    Snapshot snapshot;
+    std::vector<Change> changes;
+
+    // Epoch and version of the relay we got the working copy from.
+    std::string epoch;
+    uint64_t version;
+
+    // Whether instances were ramping as of the last publish, which then
+    // has to be repeated to move their weights on.
+    bool ramping;
+
+    // Confirmed by the first message of every relay followed.
+    Staleness staleness;
+
+    // Where the relay followed last sent us, if anywhere.
+    Option<std::string> redirected;
+
+    std::atomic<bool> stopping;
+    std::mutex mutex;
+    std::condition_variable stopped;
+    // Connection to the current relay, shut down to stop.
+    int fd;
+    std::thread thread;
+};
+
+#endif // __SERVICE_DISCOVERY_RELAY_HPP__
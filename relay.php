@@ -0,0 +1,140 @@
+<?php
+// Stand-in for a relay (see relay.hpp) to try hosts against without an
+// ensemble. Serves the services of a file laid out as snapshot.json, and
+// sends them again whenever the file changes:
+//
+//     php relay.php unix:/tmp/relay.sock snapshot.json
+//
+// with service-discovery.relays=unix:/tmp/relay.sock on the hosts. Stop
+// it to have hosts fail over, or leave it quiet to see pings keep them.
+if ($argc != 3) {
+    fwrite(STDERR, "usage: php relay.php <address> <snapshot.json>\n");
+    exit(1);
+}
+$address = $argv[1];
+$file = $argv[2];
+
+if (strpos($address, "unix:") === 0) {
+    $path = substr($address, 5);
+    if (file_exists($path) && @stream_socket_client("unix://" . $path) === false) {
+        unlink($path);
+    }
+    $server = stream_socket_server("unix://" . $path, $errno, $errstr);
+} else {
+    $server = stream_socket_server("tcp://" . $address, $errno, $errstr);
+}
+if ($server === false) {
+    fwrite(STDERR, "failed to listen on $address: $errstr\n");
+    exit(1);
+}
+
+$epoch = (string) mt_rand();
+$version = 0;
+$registry = null;
+$modified = 0;
+$hosts = array();
+$nextPing = microtime(true) + 5;
+
+function frame($message) {
+    $payload = json_encode($message);
+    return pack("N", strlen($payload)) . $payload;
+}
+
+function snapshot() {
+    global $epoch, $version, $registry;
+    return frame(array("type" => "snapshot", "epoch" => $epoch, "version" => (string) $version,
+                       "registry" => $registry));
+}
+
+// Picks the file up again once it changed, true if it did.
+function reload() {
+    global $file, $version, $registry, $modified;
+    clearstatcache();
+    $mtime = @filemtime($file);
+    if ($mtime === false || $mtime == $modified) {
+        return false;
+    }
+    $loaded = json_decode(file_get_contents($file));
+    if (!is_object($loaded) || !isset($loaded->services)) {
+        echo "ignoring $file, not a snapshot\n";
+        $modified = $mtime;
+        return false;
+    }
+    $modified = $mtime;
+    $registry = $loaded;
+    $version++;
+    echo "serving version $version of $file\n";
+    return true;
+}
+
+reload();
+echo "relaying on $address in epoch $epoch\n";
+while (true) {
+    $read = array($server);
+    foreach ($hosts as $host) {
+        $read[] = $host["socket"];
+    }
+    $write = null;
+    $except = null;
+    if (stream_select($read, $write, $except, 1) === false) {
+        break;
+    }
+
+    foreach ($read as $socket) {
+        if ($socket === $server) {
+            $accepted = stream_socket_accept($server);
+            if ($accepted !== false) {
+                $hosts[(int) $accepted] = array("socket" => $accepted, "input" => "", "greeted" => false,
+                                                "served" => false);
+            }
+            continue;
+        }
+        $id = (int) $socket;
+        $data = fread($socket, 65536);
+        if ($data === false || $data === "") {
+            fclose($socket);
+            unset($hosts[$id]);
+            continue;
+        }
+        $hosts[$id]["input"] .= $data;
+        while (strlen($hosts[$id]["input"]) >= 4) {
+            $length = unpack("N", $hosts[$id]["input"])[1];
+            if (strlen($hosts[$id]["input"]) < 4 + $length) {
+                break;
+            }
+            $message = json_decode(substr($hosts[$id]["input"], 4, $length), true);
+            $hosts[$id]["input"] = substr($hosts[$id]["input"], 4 + $length);
+            if (!is_array($message) || $message["type"] != "hello") {
+                echo "dropping host, unexpected frame\n";
+                fclose($socket);
+                unset($hosts[$id]);
+                break;
+            }
+            // Changes are not kept, every host gets the whole registry.
+            $hosts[$id]["greeted"] = true;
+            if ($registry !== null) {
+                fwrite($socket, snapshot());
+                $hosts[$id]["served"] = true;
+            }
+        }
+    }
+
+    if (reload()) {
+        foreach ($hosts as $id => $host) {
+            if ($host["greeted"]) {
+                fwrite($host["socket"], snapshot());
+                $hosts[$id]["served"] = true;
+            }
+        }
+    }
+    if (microtime(true) >= $nextPing) {
+        $nextPing = microtime(true) + 5;
+        // Only hosts following our epoch take pings.
+        foreach ($hosts as $host) {
+            if ($host["served"]) {
+                fwrite($host["socket"], frame(array("type" => "ping", "epoch" => $epoch,
+                                                    "version" => (string) $version)));
+            }
+        }
+    }
+}
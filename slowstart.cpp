@@ -0,0 +1,52 @@
+#include <math.h>
+
+#include <chrono>
+
+#include "registry.hpp"
+#include "slowstart.hpp"
+
+SlowStart::SlowStart() : windowMs(0), floor(0), intervalMs(1000) { }
+
+bool SlowStart::isRamping(const Instance &instance, int64_t nowMs) const {
+    // Instances of unknown age, e.g. read from manifests of older
+    // aggregators, are taken as warm.
+    return windowMs > 0 && instance.ctime > 0 && nowMs - instance.ctime < windowMs;
+}
+
+bool SlowStart::isRamping(const Snapshot &snapshot, int64_t nowMs) const {
+    if (windowMs <= 0) {
+        return false;
+    }
+    for (auto &service : snapshot.services) {
+        for (auto &instance : service.second.instances) {
+            if (isRamping(instance, nowMs)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uint64_t SlowStart::ramp(const Instance &instance, uint64_t weight, int64_t nowMs) const {
+    if (!isRamping(instance, nowMs)) {
+        return weight * SCALE;
+    }
+
+    // Clocks ahead of the ensemble leave instances at the floor a bit
+    // longer, never above their weight.
+    double share = floor;
+    if (nowMs > instance.ctime) {
+        share += (1 - floor) * (nowMs - instance.ctime) / windowMs;
+    }
+    uint64_t ramped = llround(weight * SCALE * share);
+    // Still picked now and then, unless weighing nothing at all.
+    if (ramped == 0 && weight > 0) {
+        ramped = 1;
+    }
+    return ramped;
+}
+
+int64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
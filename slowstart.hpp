@@ -0,0 +1,45 @@
+#ifndef __SERVICE_DISCOVERY_SLOWSTART_HPP__
+#define __SERVICE_DISCOVERY_SLOWSTART_HPP__
+
+#include <stdint.h>
+
+struct Instance;
+struct Snapshot;
+
+// Spares instances that just registered the full share of requests
+// while they warm up. Over a window after the creation of its znode,
+// the weight an instance is picked by ramps from a floor up to its
+// configured weight. Creation times come from ZooKeeper, so that all
+// hosts ramp alike however late they learn about an instance.
+//
+// Ramped weights are settled when a snapshot is packed, not per pick,
+// so whoever publishes republishes now and then while any instance is
+// ramping, see interval.
+struct SlowStart {
+    SlowStart();
+
+    // Zero to give instances their full weight right away.
+    int64_t windowMs;
+
+    // Share of its weight an instance starts with, in [0, 1].
+    double floor;
+
+    // How often ramped weights are settled again.
+    int64_t intervalMs;
+
+    bool isRamping(const Instance &instance, int64_t nowMs) const;
+
+    // Whether any instance is ramping.
+    bool isRamping(const Snapshot &snapshot, int64_t nowMs) const;
+
+    // Weight 'weight' ramped for the instance, in units of 1/SCALE so
+    // that small weights ramp smoothly too.
+    uint64_t ramp(const Instance &instance, uint64_t weight, int64_t nowMs) const;
+
+    static const uint64_t SCALE = 1000;
+};
+
+// Milliseconds since the epoch, as ZooKeeper creation times are.
+int64_t wallClockMs();
+
+#endif // __SERVICE_DISCOVERY_SLOWSTART_HPP__
@@ -0,0 +1,20 @@
+#include <algorithm>
+
+#include "slowstart.hpp"
+#include "staleness.hpp"
+
+Staleness::Staleness() : since(wallClockMs()) { }
+
+void Staleness::confirm() {
+    since = 0;
+}
+
+void Staleness::lapse() {
+    int64_t expected = 0;
+    since.compare_exchange_strong(expected, wallClockMs());
+}
+
+int64_t Staleness::ms(int64_t nowMs) const {
+    int64_t lapsed = since;
+    return lapsed == 0 ? 0 : std::max(nowMs - lapsed, (int64_t) 0);
+}
@@ -0,0 +1,35 @@
+#ifndef __SERVICE_DISCOVERY_STALENESS_HPP__
+#define __SERVICE_DISCOVERY_STALENESS_HPP__
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Tells how long a working copy has been out of sync with where it is
+// read from, e.g. since the session to the ensemble dropped. A copy is
+// in sync from the moment it was read completely over a connection
+// that tells about changes, until that connection is lost. Updated by
+// the thread keeping the copy in sync, read by any.
+class Staleness {
+public:
+    // Out of sync from the start, as whatever was loaded before the
+    // first sync is of unknown age.
+    Staleness();
+
+    // In sync as of now, until lapse() is called.
+    void confirm();
+
+    // Out of sync from now on, unless it already was.
+    void lapse();
+
+    // How long the copy has been out of sync by 'nowMs', 0 while in
+    // sync.
+    int64_t ms(int64_t nowMs) const;
+
+private:
+    // When the copy went out of sync, in milliseconds since the epoch,
+    // 0 while in sync.
+    std::atomic<int64_t> since;
+};
+
+#endif // __SERVICE_DISCOVERY_STALENESS_HPP__
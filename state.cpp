@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <stout/error.hpp>
+#include <stout/none.hpp>
+#include <stout/os.hpp>
+
+#include "state.hpp"
+
+using std::string;
+
+const int MAX_SESSION_SLOTS = 1024;
+const string SNAPSHOT_FILE = "snapshot.json";
+const string REGISTRY_FILE = "registry.bin";
+const string LEADER_FILE = "leader.lock";
+
+StateStore::StateStore(const string &_directory, const string &_servers, bool _shareRegistry)
+        : directory(_directory),
+          servers(_servers),
+          shareRegistry(_shareRegistry),
+          fd(-1),
+          leaderFd(-1),
+          registryDevice(0),
+          registryInode(0) {
+    loadedModified.tv_sec = 0;
+    loadedModified.tv_nsec = 0;
+}
+
+StateStore::~StateStore() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    dropLeadership();
+}
+
+Try<Nothing> StateStore::acquire() {
+    if (fd >= 0) {
+        return Nothing();
+    }
+
+    Try<Nothing> prepared = prepare(true);
+    if (prepared.isError()) {
+        return prepared;
+    }
+
+    for (int slot = 0; slot < MAX_SESSION_SLOTS; slot++) {
+        string path = directory + "/session." + std::to_string(slot);
+        int slotFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (slotFd < 0) {
+            return ErrnoError("failed to open " + path);
+        }
+        if (flock(slotFd, LOCK_EX | LOCK_NB) == 0) {
+            fd = slotFd;
+            return Nothing();
+        }
+        close(slotFd);
+    }
+
+    return Error("all session slots in " + directory + " are taken");
+}
+
+Option<clientid_t> StateStore::loadSession() {
+    if (fd < 0) {
+        return None();
+    }
+
+    char buffer[1024];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return None();
+    }
+    buffer[length] = '\0';
+
+    // A session is stored as "<servers>\n<id>\n<hex password>\n".
+    std::istringstream is(buffer);
+    string sessionServers, id, password;
+    if (!std::getline(is, sessionServers) || !std::getline(is, id) || !std::getline(is, password)) {
+        return None();
+    }
+    clientid_t clientId;
+    if (sessionServers != servers || password.size() != 2 * sizeof(clientId.passwd)) {
+        return None();
+    }
+    clientId.client_id = strtoll(id.c_str(), NULL, 10);
+    for (size_t i = 0; i < sizeof(clientId.passwd); i++) {
+        clientId.passwd[i] = (char) strtol(password.substr(2 * i, 2).c_str(), NULL, 16);
+    }
+    if (clientId.client_id == 0) {
+        return None();
+    }
+    return clientId;
+}
+
+Try<Nothing> StateStore::saveSession(const clientid_t &clientId) {
+    if (fd < 0) {
+        return Error("no session slot acquired");
+    }
+
+    std::ostringstream out;
+    out << servers << "\n" << clientId.client_id << "\n";
+    char hex[3];
+    for (size_t i = 0; i < sizeof(clientId.passwd); i++) {
+        snprintf(hex, sizeof(hex), "%02x", (unsigned char) clientId.passwd[i]);
+        out << hex;
+    }
+    out << "\n";
+
+    // Written in place, renaming a new file over the slot would drop
+    // our lock along with the old inode.
+    string data = out.str();
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, data.data(), data.size(), 0) != (ssize_t) data.size()) {
+        return ErrnoError("failed to save session");
+    }
+    return Nothing();
+}
+
+void StateStore::clearSession() {
+    if (fd >= 0) {
+        ftruncate(fd, 0);
+    }
+}
+
+Try<bool> StateStore::lead() {
+    if (leaderFd < 0) {
+        Try<Nothing> prepared = prepare(true);
+        if (prepared.isError()) {
+            return Error(prepared.error());
+        }
+        string path = directory + "/" + LEADER_FILE;
+        leaderFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (leaderFd < 0) {
+            return ErrnoError("failed to open " + path);
+        }
+    }
+    if (flock(leaderFd, LOCK_EX | LOCK_NB) == 0) {
+        return true;
+    }
+    if (errno == EWOULDBLOCK) {
+        return false;
+    }
+    return ErrnoError("failed to lock " + directory + "/" + LEADER_FILE);
+}
+
+void StateStore::dropLeadership() {
+    if (leaderFd >= 0) {
+        close(leaderFd);
+        leaderFd = -1;
+    }
+}
+
+Try<Snapshot> StateStore::loadSnapshot() {
+    Try<Nothing> prepared = prepare(false);
+    if (prepared.isError()) {
+        return Error(prepared.error());
+    }
+    string path = directory + "/" + SNAPSHOT_FILE;
+    struct stat info;
+    std::ifstream file(path);
+    if (!file || stat(path.c_str(), &info) != 0) {
+        return Error("no snapshot in " + directory);
+    }
+    std::stringstream data;
+    data << file.rdbuf();
+    Try<Snapshot> snapshot = deserialize(data.str());
+    if (snapshot.isSome()) {
+        loadedModified = info.st_mtim;
+    }
+    return snapshot;
+}
+
+Result<Snapshot> StateStore::loadNewerSnapshot() {
+    string path = directory + "/" + SNAPSHOT_FILE;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        if (errno == ENOENT) {
+            return None();
+        }
+        return ErrnoError("failed to stat " + path);
+    }
+    if (info.st_mtim.tv_sec < loadedModified.tv_sec ||
+        (info.st_mtim.tv_sec == loadedModified.tv_sec && info.st_mtim.tv_nsec <= loadedModified.tv_nsec)) {
+        return None();
+    }
+    Try<Snapshot> snapshot = loadSnapshot();
+    if (snapshot.isError()) {
+        return Error(snapshot.error());
+    }
+    return snapshot.get();
+}
+
+Try<Nothing> StateStore::saveSnapshot(const Snapshot &snapshot) {
+    Try<Nothing> prepared = prepare(true);
+    if (prepared.isError()) {
+        return prepared;
+    }
+
+    // Several processes may save at once, each writes its own file and
+    // atomically renames it over the previous snapshot.
+    string path = directory + "/" + SNAPSHOT_FILE;
+    string temporary = path + "." + std::to_string(getpid());
+    int temporaryFd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (temporaryFd < 0) {
+        return ErrnoError("failed to open " + temporary);
+    }
+    // Written through the descriptor opened above, reopening the path
+    // would follow whatever was put in its place meanwhile.
+    string data = serialize(snapshot);
+    const char *remaining = data.data();
+    size_t length = data.size();
+    while (length > 0) {
+        ssize_t written = write(temporaryFd, remaining, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            ErrnoError error("failed to write " + temporary);
+            close(temporaryFd);
+            unlink(temporary.c_str());
+            return error;
+        }
+        remaining += written;
+        length -= written;
+    }
+    if (fsync(temporaryFd) != 0) {
+        ErrnoError error("failed to sync " + temporary);
+        close(temporaryFd);
+        unlink(temporary.c_str());
+        return error;
+    }
+    close(temporaryFd);
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return ErrnoError("failed to rename " + temporary);
+    }
+    return Nothing();
+}
+
+Try<Nothing> StateStore::saveRegistry(const PackedSnapshot &snapshot) {
+    if (!shareRegistry) {
+        return Nothing();
+    }
+    Try<Nothing> prepared = prepare(true);
+    if (prepared.isError()) {
+        return prepared;
+    }
+    return snapshot.save(directory + "/" + REGISTRY_FILE);
+}
+
+Result<std::shared_ptr<const PackedSnapshot> > StateStore::mapRegistry() {
+    if (!shareRegistry) {
+        return None();
+    }
+    Try<Nothing> prepared = prepare(false);
+    if (prepared.isError()) {
+        return Error(prepared.error());
+    }
+    string path = directory + "/" + REGISTRY_FILE;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        if (errno == ENOENT) {
+            return None();
+        }
+        return ErrnoError("failed to stat " + path);
+    }
+    if (info.st_dev == registryDevice && info.st_ino == registryInode) {
+        return None();
+    }
+
+    Try<std::shared_ptr<const PackedSnapshot> > snapshot = PackedSnapshot::map(path);
+    if (snapshot.isError()) {
+        return Error(snapshot.error());
+    }
+    // Swapped again in between, we catch up with it next time.
+    registryDevice = info.st_dev;
+    registryInode = info.st_ino;
+    loadedModified = info.st_mtim;
+    return snapshot.get();
+}
+
+Try<Nothing> StateStore::prepare(bool create) {
+    struct stat info;
+    if (lstat(directory.c_str(), &info) != 0) {
+        if (errno != ENOENT || !create) {
+            return ErrnoError("failed to stat " + directory);
+        }
+        // Parents are created as usual, only the directory itself is
+        // kept to ourselves.
+        size_t slash = directory.find_last_of('/');
+        if (slash != string::npos && slash > 0) {
+            Try<Nothing> parent = os::mkdir(directory.substr(0, slash));
+            if (parent.isError()) {
+                return Error("failed to create " + directory + ": " + parent.error());
+            }
+        }
+        if (::mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+            return ErrnoError("failed to create " + directory);
+        }
+        if (lstat(directory.c_str(), &info) != 0) {
+            return ErrnoError("failed to stat " + directory);
+        }
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        return Error(directory + " is not a directory");
+    }
+    if (info.st_uid != geteuid()) {
+        return Error(directory + " is owned by another user");
+    }
+    if ((info.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        return Error(directory + " is writable by other users");
+    }
+    return Nothing();
+}
@@ -0,0 +1,106 @@
+#ifndef __SERVICE_DISCOVERY_STATE_HPP__
+#define __SERVICE_DISCOVERY_STATE_HPP__
+
+#include <sys/types.h>
+#include <zookeeper.h>
+
+#include <memory>
+#include <string>
+
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/try.hpp>
+
+#include "registry.hpp"
+
+// State shared by the extension instances of a host, so that a
+// recycled worker can pick up where its predecessor left off:
+//
+//     <directory>/session.<slot>   id and password of a ZooKeeper session
+//     <directory>/snapshot.json    registry snapshot saved on shutdown
+//     <directory>/registry.bin     latest packed snapshot, for readers to map
+//     <directory>/leader.lock      held by the process syncing for the host
+//
+// Each process holds one session slot, locked with flock() for as long
+// as it lives, so no two live processes ever resume the same session.
+// The lock goes away with the process, crashed or not, and the slot
+// becomes free for the next process to resume its session.
+//
+// Sessions are credentials and snapshots are served as is, so the
+// directory is created private to the user, and one owned by another
+// user or writable by others is refused.
+class StateStore {
+public:
+    // The registry file is only kept when 'shareRegistry', i.e. when a
+    // single process of the host syncs and the others follow it.
+    // Otherwise every process would rewrite it on each publish, for no
+    // one to read.
+    StateStore(const std::string &directory, const std::string &servers, bool shareRegistry);
+
+    ~StateStore();
+
+    // Locks the first free session slot.
+    Try<Nothing> acquire();
+
+    Option<clientid_t> loadSession();
+
+    Try<Nothing> saveSession(const clientid_t &clientId);
+
+    void clearSession();
+
+    // Tries to become the one process of the host that syncs with the
+    // ensemble. Like session slots, leadership is an flock() that lasts
+    // for as long as the process, so it passes on once the leader exits.
+    Try<bool> lead();
+
+    // Closes our copy of the leader lock without unlocking it, for a
+    // child forked from the leader not to keep leadership from passing
+    // on once the leader exits.
+    void dropLeadership();
+
+    Try<Snapshot> loadSnapshot();
+
+    // Loads the snapshot only if it was saved after whatever this store
+    // loaded or mapped last, none otherwise. A recycled worker inherits
+    // what the master loaded at startup, while its predecessors kept
+    // saving since.
+    Result<Snapshot> loadNewerSnapshot();
+
+    Try<Nothing> saveSnapshot(const Snapshot &snapshot);
+
+    // Does nothing unless the registry is shared.
+    Try<Nothing> saveRegistry(const PackedSnapshot &snapshot);
+
+    // Maps the registry file if it was swapped since it was last mapped
+    // by this store, returns none when it was not or when the registry
+    // is not shared.
+    Result<std::shared_ptr<const PackedSnapshot> > mapRegistry();
+
+private:
+    // Checks the directory is ours alone, creating it if asked to.
+    Try<Nothing> prepare(bool create);
+
+    const std::string directory;
+
+    // Sessions are only resumed against the ensemble they belong to.
+    const std::string servers;
+
+    const bool shareRegistry;
+
+    // The locked session slot, -1 until acquired.
+    int fd;
+
+    // The leader lock, -1 until opened. Locked if we lead.
+    int leaderFd;
+
+    // Identifies the registry file mapped last. Its inode cannot be
+    // reused for another file while the mapping is referenced.
+    dev_t registryDevice;
+    ino_t registryInode;
+
+    // When the file loaded or mapped last was modified.
+    struct timespec loadedModified;
+};
+
+#endif // __SERVICE_DISCOVERY_STATE_HPP__
@@ -1,4 +1,5 @@
 <?php
+$version = 0;
 while(true){
 $before = microtime(true);
 $service = service_discovery_get("hello");
@@ -9,5 +10,8 @@ echo "get service hello \n";
 var_dump(service_discovery_get("hello"));
 echo "get one service hello \n";
 var_dump(service_discovery_get_one("hello"));
-sleep(2);
+echo "get many services hello, world \n";
+var_dump(service_discovery_get_many(array("hello", "world"), SERVICE_DISCOVERY_ADDRESS));
+echo "wait for hello to change \n";
+$version = service_discovery_wait("hello", $version, 2000);
 }
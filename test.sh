@@ -1,4 +1,4 @@
-rm -f service-discovery.so main.o
+make clean
 make
 make install
 php test.php
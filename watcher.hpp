@@ -55,6 +55,12 @@ public:
         // If this watcher gets reused then the next connected
         // event shouldn't be perceived as a reconnect.
         reconnect = false;
+      } else if (state == ZOO_READONLY_STATE) {
+        // Connected to a server cut off from the quorum, only for
+        // sessions that asked for it. Once the client library finds
+        // a read-write server it connects again.
+        process::dispatch(pid, &T::connectedReadOnly, sessionId);
+        reconnect = false;
       } else if (state == ZOO_CONNECTING_STATE) {
         // The client library automatically reconnects, taking
         // into account failed servers in the connection string,
@@ -76,7 +82,7 @@ public:
     } else if (type == ZOO_CHILD_EVENT) {
       process::dispatch(pid, &T::updated, sessionId, path);
     } else if (type == ZOO_CHANGED_EVENT) {
-      process::dispatch(pid, &T::updated, sessionId, path);
+      process::dispatch(pid, &T::changed, sessionId, path);
     } else if (type == ZOO_CREATED_EVENT) {
       process::dispatch(pid, &T::created, sessionId, path);
     } else if (type == ZOO_DELETED_EVENT) {
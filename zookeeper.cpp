@@ -32,6 +32,7 @@
 
 #include <stout/duration.hpp>
 #include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
 #include <stout/path.hpp>
 #include <stout/strings.hpp>
 #include <stout/unreachable.hpp>
@@ -52,12 +53,21 @@ public:
       ZooKeeper* zk,
       const string& servers,
       const Duration& timeout,
-      Watcher* watcher)
+      Watcher* watcher,
+      const clientid_t* _clientId,
+      bool _readOnly)
     : ProcessBase(ID::generate("zookeeper")),
       servers(servers),
       timeout(timeout),
+      resume(_clientId != NULL),
+      readOnly(_readOnly),
+      detached(false),
       zh(NULL)
   {
+    if (resume) {
+      clientId = *_clientId;
+    }
+
     // We bind the Watcher::process callback so we can pass it to the
     // C callback as a pointer and invoke it directly.
     callback = lambda::bind(
@@ -86,9 +96,9 @@ public:
           servers.c_str(),
           event,
           static_cast<int>(timeout.ms()),
-          NULL,
+          resume ? &clientId : NULL,
           &callback,
-          0);
+          readOnly ? ZOO_READONLY : 0);
 
       // Unfortunately, EINVAL is highly overloaded in zookeeper_init
       // and can correspond to:
@@ -113,6 +123,15 @@ public:
 
   virtual void finalize()
   {
+    if (detached) {
+      // There is no way to drop the connection without closing the
+      // session, so the handle is intentionally leaked. We only make
+      // sure that no more events are delivered to our callback, which
+      // is about to go away together with this process.
+      zoo_set_watcher(zh, ignore);
+      return;
+    }
+
     int ret = zookeeper_close(zh);
     if (ret != ZOK) {
       LOG(FATAL) << "Failed to cleanup ZooKeeper, zookeeper_close: "
@@ -130,6 +149,17 @@ public:
     return zoo_client_id(zh)->client_id;
   }
 
+  clientid_t getClientId()
+  {
+    return *zoo_client_id(zh);
+  }
+
+  Nothing detach()
+  {
+    detached = true;
+    return Nothing();
+  }
+
   Duration getSessionTimeout()
   {
     // ZooKeeper server uses int representation of milliseconds for
@@ -400,6 +430,14 @@ private:
     (*callback)(type, state, zoo_client_id(zh)->client_id, string(path));
   }
 
+  // Replaces 'event' as the watcher once the handle is detached.
+  static void ignore(
+      zhandle_t* zh,
+      int type,
+      int state,
+      const char* path,
+      void* context) {}
+
   static void voidCompletion(int ret, const void *data)
   {
     const tuple<Promise<int>*>* args =
@@ -514,6 +552,13 @@ private:
   const string servers; // ZooKeeper host:port pairs.
   const Duration timeout; // ZooKeeper session timeout;
 
+  const bool resume; // Whether to resume the session in 'clientId'.
+  clientid_t clientId;
+
+  const bool readOnly; // Whether read-only servers will do.
+
+  bool detached; // Whether to keep the session open on finalize.
+
   zhandle_t* zh; // ZooKeeper connection handle.
 
   // Callback for invoking Watcher::process with the 'Watcher*'
@@ -525,9 +570,13 @@ private:
 ZooKeeper::ZooKeeper(
     const string& servers,
     const Duration& timeout,
-    Watcher* watcher)
+    Watcher* watcher,
+    const clientid_t* clientId,
+    bool readOnly)
+  : latency(0)
 {
-  process = new ZooKeeperProcess(this, servers, timeout, watcher);
+  process =
+    new ZooKeeperProcess(this, servers, timeout, watcher, clientId, readOnly);
   spawn(process);
 }
 
@@ -552,12 +601,42 @@ int64_t ZooKeeper::getSessionId()
 }
 
 
+clientid_t ZooKeeper::getClientId()
+{
+  return dispatch(process, &ZooKeeperProcess::getClientId).get();
+}
+
+
+void ZooKeeper::detach()
+{
+  // Wait for the flag to be set, termination events jump the queue.
+  dispatch(process, &ZooKeeperProcess::detach).get();
+}
+
+
 Duration ZooKeeper::getSessionTimeout() const
 {
   return dispatch(process, &ZooKeeperProcess::getSessionTimeout).get();
 }
 
 
+Duration ZooKeeper::getLatency() const
+{
+  return Nanoseconds(latency.load());
+}
+
+
+void ZooKeeper::observe(const std::chrono::steady_clock::time_point& start)
+{
+  int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  int64_t current = latency.load();
+
+  // Weighs the latest sample by 1/8, like TCP does round trip times.
+  latency = current == 0 ? sample : current + (sample - current) / 8;
+}
+
+
 int ZooKeeper::authenticate(const string& scheme, const string& credentials)
 {
   return dispatch(
@@ -596,24 +675,30 @@ int ZooKeeper::remove(const string& path, int version)
 
 int ZooKeeper::exists(const string& path, bool watch, Stat* stat)
 {
-  return dispatch(
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int code = dispatch(
       process,
       &ZooKeeperProcess::exists,
       path,
       watch,
       stat).get();
+  observe(start);
+  return code;
 }
 
 
 int ZooKeeper::get(const string& path, bool watch, string* result, Stat* stat)
 {
-  return dispatch(
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int code = dispatch(
       process,
       &ZooKeeperProcess::get,
       path,
       watch,
       result,
       stat).get();
+  observe(start);
+  return code;
 }
 
 
@@ -622,12 +707,15 @@ int ZooKeeper::getChildren(
     bool watch,
     vector<string>* results)
 {
-  return dispatch(
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int code = dispatch(
       process,
       &ZooKeeperProcess::getChildren,
       path,
       watch,
       results).get();
+  observe(start);
+  return code;
 }
 
 
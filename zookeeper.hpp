@@ -28,6 +28,8 @@
 
 #include <stdint.h>
 #include <zookeeper.h>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <stout/duration.hpp>
@@ -119,10 +121,20 @@ public:
    * \param watcher the instance of Watcher that receives event
    *    callbacks. When notifications are triggered the Watcher::process
    *    method will be invoked.
+   * \param clientId the id and password of a previously established
+   *    session to resume, or NULL to start a new session. If the
+   *    session has already expired the watcher gets a session event
+   *    of state ZOO_EXPIRED_SESSION_STATE.
+   * \param readOnly whether to settle for a read-only server while no
+   *    quorum can be reached, see ZOO_READONLY. The watcher then gets
+   *    a session event of state ZOO_READONLY_STATE, and another one of
+   *    state ZOO_CONNECTED_STATE once a read-write server is found.
    */
   ZooKeeper(const std::string& servers,
             const Duration& timeout,
-            Watcher* watcher);
+            Watcher* watcher,
+            const clientid_t* clientId = NULL,
+            bool readOnly = false);
 
   ~ZooKeeper();
 
@@ -140,6 +152,23 @@ public:
    */
   int64_t getSessionId();
 
+  /**
+   * \brief get the id and password of the current session.
+   *
+   * The returned client id can be handed to another ZooKeeper instance
+   * (possibly in another process) to resume this session.
+   */
+  clientid_t getClientId();
+
+  /**
+   * \brief keep the session open when this instance is destroyed.
+   *
+   * Normally the session is closed on destruction. A detached session
+   * is left alive on the server until it either times out or is
+   * resumed by another client using the id from getClientId().
+   */
+  void detach();
+
   /**
    * \brief get the current session timeout.
    *
@@ -148,6 +177,15 @@ public:
    */
   Duration getSessionTimeout() const;
 
+  /**
+   * \brief get the smoothed latency of read operations.
+   *
+   * An exponentially weighted moving average of how long exists, get
+   * and getChildren took to complete, zero until one has. Lets callers
+   * back off while the ensemble is slow.
+   */
+  Duration getLatency() const;
+
   /**
    * \brief authenticate synchronously.
    */
@@ -323,6 +361,12 @@ protected:
   ZooKeeperProcess* process;
 
 private:
+  /* Folds an operation started at 'start' into the latency. */
+  void observe(const std::chrono::steady_clock::time_point& start);
+
+  /* Smoothed read latency in nanoseconds. */
+  std::atomic<int64_t> latency;
+
   /* ZooKeeper instances are not copyable. */
   ZooKeeper(const ZooKeeper& that);
   ZooKeeper& operator=(const ZooKeeper& that);